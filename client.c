@@ -31,12 +31,31 @@
 #include <fcntl.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <unistd.h>
 #include <time.h>
 
 #define LEN	200
 #define BUF_SIZE 20000
 #define SERVER_PORT 7734
 #define PEER_PORT 7735
+#define MAX_UPLOAD_EVENTS 64      // events handled per epoll_wait() call
+#define UPLOAD_REQUEST_SIZE 1024  // largest download request we accept
+#define UPLOAD_REPLY_SIZE 1024    // room for a reply header with every field at its longest
+#define UPLOAD_TIMEOUT 10         // seconds to wait on a downloader: for its next request, to take the reply, or to close
+#define DOWNLOAD_BUF_SIZE 65536   // file data is received through this much memory
+#define PEER_MAX_IN_FLIGHT 16     // GETs outstanding to any one peer
+#define MAX_HOLDERS 32            // peers per RFC that a download will try
+#define MAX_DOWNLOAD_EVENTS 64    // events handled per epoll_wait() call
+#define PEER_TIMEOUT 10           // seconds a holder has to connect, or to send more of a reply
+#define SLICE_SIZE 262144         // bytes asked of one holder when several have a file
+#define CHECKSUM_PREFIX "crc32:"  // a checksum is this and 8 hex digits
+#define ADDRESS_PREFIX "addr:"    // an address in a LOOKUP row is this and a dotted quad
+#define RESOLVE_TTL 300           // seconds a hostname's address is trusted for
+#define BULKADD_BATCH_SIZE 262144 // most bytes in one BULKADD, well under the server's 1MB request limit
 #define DEBUG printf
 //#define DEBUG //
 //#define DEBUG2 printf
@@ -47,6 +66,140 @@ char serverHostname[LEN];
 char peerHostForRFC[LEN];
 int peerPortForRFC;
 
+// RFCs this peer has locally and registers with the server
+typedef struct localRfc {
+	int number;
+	char *title;
+	int hasChecksum;          // set by checksumMyRfcs() if the file is there
+	unsigned int checksum;    // CRC-32 of the file
+	time_t mtime;             // when the file was last changed, as checksummed
+	off_t size;
+} localRfc;
+
+localRfc myRfcs[] = {
+	{ 123, "A test rfc" },
+	{ 456, "Just another rfc" },
+};
+int myRfcCount = sizeof(myRfcs) / sizeof(myRfcs[0]);
+
+// A hostname we know the address of, from a lookup or a LOOKUP row
+typedef struct resolvedHost {
+	char hostname[LEN];
+	struct in_addr address;
+	int hinted;               // from a LOOKUP row rather than the resolver
+	time_t expires;           // look it up again after this
+	struct resolvedHost *next;
+} resolvedHost;
+
+resolvedHost *resolvedHead = NULL;
+
+// A peer that has an RFC, as listed by LOOKUP
+typedef struct holder {
+	char hostname[LEN];
+	int port;
+} holder;
+
+// Fetch and slice states
+#define FETCH_WAITING 0 // slice not yet asked for (or asked again after a failure)
+#define FETCH_ACTIVE  1 // slice: GET sent to a holder; fetch: slices still to come
+#define FETCH_DONE    2 // saved to disk
+#define FETCH_FAILED  3 // every holder failed us
+
+struct fetch;
+
+// A byte range of an RFC, asked of one holder with a single GET. A file
+// held by several peers is fetched in SLICE_SIZE slices so that every
+// holder sends part of it.
+typedef struct slice {
+	struct fetch *f;
+	long long first;          // first byte of the file in this slice
+	long long end;            // one past the last byte, or -1 for the whole file
+	char tried[MAX_HOLDERS];  // holders that already failed this slice
+	int current;              // holder it is ACTIVE on
+	int state;                // one of the FETCH_ states
+	unsigned int crc;         // CRC-32 of the bytes of it received so far
+	struct slice *next;
+} slice;
+
+// One RFC to download, and every peer we may download it from
+typedef struct fetch {
+	int rfc;
+	holder holders[MAX_HOLDERS];
+	int holderCount;
+	long long size;           // file size, or -1 until a reply tells us
+	int hasChecksum;          // we know what the file's CRC-32 should be
+	unsigned int checksum;
+	int fd;                   // RFC<n>.txt.part once a reply has arrived, else -1
+	slice *slices;
+	int slicesLeft;           // slices not yet DONE
+	int state;                // one of the FETCH_ states
+} fetch;
+
+// Download reply states
+#define DL_HEADER 0 // reading a reply header
+#define DL_BODY   1 // writing a reply body to disk
+
+// A connection to one peer we are downloading from. GETs are pipelined on
+// it, and the replies, which come back in the same order, are matched up
+// with the slices in queue. Replies arrive back to back, so bytes read
+// past the end of one reply are kept in buf for the next.
+typedef struct download {
+	char hostname[LEN];
+	int port;
+	int socket;               // -1 when not connected
+	int connecting;           // connect() still in progress; GETs wait for it
+	struct in_addr address;   // where we are connecting to
+	int hinted;               // address is only a hint from a LOOKUP row
+	int fail;                 // send bad requests, to test the peer's errors
+	long long deadline;       // when a holder with GETs outstanding is given up on
+	int dead;                 // dropped us; not used again for this batch
+	int replies;              // replies received on this connection
+	slice *queue[PEER_MAX_IN_FLIGHT]; // GETs sent, oldest first
+	int queueHead;
+	int queueCount;
+	int state;                // one of the DL_ states
+	int keepAlive;            // peer keeps the connection after this reply
+	int bodyOk;               // the body is the slice we asked for
+	long long offset;         // where in the file the body starts
+	long long length;         // Content-Length, or -1 to read until close
+	long long received;
+	char buf[DOWNLOAD_BUF_SIZE + 1];
+	int start;                // unread data is buf[start] to buf[have - 1]
+	int have;
+	struct download *next;
+} download;
+
+// Upload connection states
+#define UP_READ_REQUEST 0 // reading a GET request
+#define UP_SEND_REPLY   1 // sending the reply header and file
+#define UP_CLOSING      2 // reply sent, waiting for the downloader to close
+
+// One download being served by our upload server. All downloads are served
+// from a single epoll loop, so everything needed to pick a transfer back up
+// when its socket is ready again lives here.
+typedef struct upload {
+	int socket;
+	int state;              // one of the UP_ states
+	char request[UPLOAD_REQUEST_SIZE];
+	int requestLen;
+	char reply[UPLOAD_REPLY_SIZE]; // reply header (or error reply)
+	int keepAlive;          // downloader asked to send more requests afterwards
+	int replyLen;
+	int replySent;
+	int fd;                 // file being sent, or -1
+	off_t offset;           // next byte of the file to send
+	off_t end;              // one past the last byte to send
+	long long deadline;     // when a downloader we are waiting on is given up on
+	struct upload *waitPrev;
+	struct upload *waitNext;
+} upload;
+
+int uploadEpollFd;
+// Uploads waiting on the downloader (for a request, to take more of a reply,
+// or to close), oldest (and so soonest deadline) first
+upload *waitHead = NULL;
+upload *waitTail = NULL;
+
 /** Returns 1 on success, or 0 if there was an error */
 int setSocketBlockingEnabled(int fd, int blocking)
 {
@@ -58,16 +211,12 @@ int setSocketBlockingEnabled(int fd, int blocking)
    return (fcntl(fd, F_SETFL, flags) == 0) ? 1 : 0;
 }
 
-// We know the port value will be the last token in the response
-// that we received from the LOOKUP command.
-// Note: this will mean that we are always going to connect to the last peer
-//       listed if there are multiple peers. Should not matter.
-char* getPortValueFromLookup(char *data)
+char* getTagValue(char *data, char *tag)
 {
 	char *datacopy = malloc(strlen(data) + 1); // strtok modifies the string
-	char *result = NULL;
+	char *result = 0;
 	char *s;
-	DEBUG2("getPortValueFromLookup()\n");
+	DEBUG2("getTagValue() - %s\n", tag);
 	
 	strcpy(datacopy, data);
 	
@@ -75,19 +224,24 @@ char* getPortValueFromLookup(char *data)
 	
 	while (s)
 	{
-		// Set the last token we parsed to the Result. 
-		// When we have gone through all tokens, result
-		// should be holding the last one that we want
-		if (result == NULL)
+		if (strcmp(s, tag) == 0)
 		{
+			// When looking for title, it can have spaces, so do not
+			// add " " as a delimiter.
+			if (strcmp(tag, "Title:") == 0) {
+				s = strtok(0, "\n\r");
+			}
+			else {
+				s = strtok(0, " \n\r"); // the next token should be our value
+			}
+			if (s == NULL) {
+				break; // tag with no value
+			}
+			DEBUG2("      found value - [%s]\n", s);
 			result = malloc(strlen(s) +1);
 			strcpy(result, s);
-		}
-		else
-		{
-			free(result);
-			result = malloc(strlen(s) + 1);
-			strcpy(result, s);
+			free(datacopy);
+			return result;
 		}
 		s = strtok(0, " \n\r");
 	}
@@ -96,223 +250,1307 @@ char* getPortValueFromLookup(char *data)
 	return result;
 }
 
-// We know the host value will be the second to last token in the response
-// that we received from the LOOKUP command.
-// Note: this will mean that we are always going to connect to the last peer
-//       listed if there are multiple peers. Should not matter.
-char* getHostValueFromLookup(char *data)
+char* getTagVersion(char *data, int versionPosition)
 {
 	char *datacopy = malloc(strlen(data) + 1); // strtok modifies the string
-	char *result = NULL;
-	char *lastToken = NULL;
-	char *s;
-	DEBUG2("getHostValueFromLookup()\n");
+	char *version;
+	char *result = 0;
+	DEBUG2("getTagVersion() - version at %d\n", versionPosition);
 	
 	strcpy(datacopy, data);
 	
-	s = strtok(datacopy, " \n\r");
+	version = strtok(datacopy, " \r\n");
+	versionPosition--;
 	
-	while (s)
+	// we know the version is the nth token position based on
+	// versionPosition passed in
+	while (versionPosition && version)
 	{
-		// First set the last token to the first token we get. Then move
-		// each new token to the last, and remember the second to last
-		// one as our result we want to return. When we have gone through all
-		// tokens, result should be holding the second to last one that we want
-		if (lastToken == NULL)
-		{
-			lastToken = malloc(strlen(s) +1);
-			strcpy(lastToken, s);
-		}
-		else
-		{
-			if (result != NULL) {
-				free(result);
-			}
-			result = malloc(strlen(lastToken) + 1);
-			strcpy(result, lastToken);
-			free(lastToken);
-			lastToken = malloc(strlen(s) +1);
-			strcpy(lastToken, s);
-		}
-		s = strtok(0, " \n\r");
+		version = strtok(0, " \r\n");
+		versionPosition--;
+	}
+	if (version == NULL) {
+		// Too few tokens. Only one process serves every download now, so
+		// a short request must not bring it down.
+		free(datacopy);
+		return NULL;
 	}
-	free(lastToken);
+	
+	result = malloc(strlen(version) + 1);
+	strcpy(result, version);
 	free(datacopy);
 	
 	return result;
 }
 
-char* getTagValue(char *data, char *tag)
+char *replaceMask(char *command, char *orig, char *rep)
 {
-	char *datacopy = malloc(strlen(data) + 1); // strtok modifies the string
-	char *result = 0;
-	char *s;
-	DEBUG2("getTagValue() - %s\n", tag);
-	
-	strcpy(datacopy, data);
-	
-	s = strtok(datacopy, " \n\r");
-	
-	while (s)
-	{
-		if (strcmp(s, tag) == 0)
+	static char buffer[4096];
+	char *p;
+
+	if(!(p = strstr(command, orig))) {
+		return command;
+	}
+
+	strncpy(buffer, command, p - command); // Copy characters from 'str' start to 'orig'
+	buffer[p - command] = '\0';
+
+	sprintf(buffer + (p - command), "%s%s", rep, p + strlen(orig));
+
+	return buffer;
+}
+
+// Sends all of 'len' bytes, looping over short sends.
+// Returns the number of bytes sent, or -1 on error.
+int sendAll(int sock, char *data, int len, int flags)
+{
+	int sent = 0;
+	int n;
+
+	while (sent < len) {
+		n = send(sock, &data[sent], len - sent, flags);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		sent += n;
+	}
+	return sent;
+}
+
+// Writes all of buf to a file at offset, however many pwrite() calls that
+// takes. Slices of one file arrive on different connections, so each
+// write says where it goes.
+int writeAll(int fd, char *buf, int len, off_t offset)
+{
+	int written = 0;
+	int n;
+
+	while (written < len) {
+		n = pwrite(fd, &buf[written], len - written, offset + written);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		written += n;
+	}
+	return written;
+}
+
+// Carries a CRC-32 (the one zip uses) on over len more bytes. Start with 0.
+unsigned int crc32Update(unsigned int crc, char *data, long long len)
+{
+	static unsigned int table[256];
+	static int tableReady = 0;
+	unsigned int c;
+	int i, k;
+
+	if (!tableReady) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		tableReady = 1;
+	}
+	crc = ~crc;
+	while (len-- > 0)
+		crc = table[(crc ^ (unsigned char)*data++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Multiplies a vector by a 32x32 matrix over GF(2), for crc32Combine()
+unsigned int gf2MatrixTimes(unsigned int *mat, unsigned int vec)
+{
+	unsigned int sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+void gf2MatrixSquare(unsigned int *square, unsigned int *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2MatrixTimes(mat, mat[n]);
+}
+
+// Returns the CRC-32 of two pieces of data one after the other, given the
+// CRC-32 of each and the length of the second (as zlib's crc32_combine()).
+// Slices of a file arrive in any order, so each is checksummed as it
+// streams in and the results are put together at the end.
+unsigned int crc32Combine(unsigned int crc1, unsigned int crc2, long long len2)
+{
+	unsigned int even[32];    // operator for an even power of two zero bits
+	unsigned int odd[32];     // and for an odd power
+	unsigned int row;
+	int n;
+
+	if (len2 <= 0)
+		return crc1;
+
+	// The operator for one zero bit
+	odd[0] = 0xedb88320U;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2MatrixSquare(even, odd);  // two zero bits
+	gf2MatrixSquare(odd, even);  // four zero bits
+
+	// Apply len2 zero bytes to crc1, squaring up through the powers of two
+	do {
+		gf2MatrixSquare(even, odd);
+		if (len2 & 1)
+			crc1 = gf2MatrixTimes(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+		gf2MatrixSquare(odd, even);
+		if (len2 & 1)
+			crc1 = gf2MatrixTimes(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+	return crc1 ^ crc2;
+}
+
+// Reads a checksum token ("crc32:" and 8 hex digits). Returns 0 if str is
+// not one.
+int parseChecksum(char *str, unsigned int *checksum)
+{
+	int prefixLen = strlen(CHECKSUM_PREFIX);
+	char *end;
+
+	if (str == NULL || strlen(str) != prefixLen + 8 || strncmp(str, CHECKSUM_PREFIX, prefixLen) != 0)
+		return 0;
+	*checksum = strtoul(&str[prefixLen], &end, 16);
+	return *end == '\0';
+}
+
+// Works out the CRC-32 of each of our RFC files, to register with the
+// server and to send with the file. Files are only read through once, here.
+void checksumMyRfcs()
+{
+	char filename[100];
+	char buf[DOWNLOAD_BUF_SIZE];
+	struct stat file_stat;
+	unsigned int crc;
+	int i, fd, len;
+
+	for (i = 0; i < myRfcCount; i++) {
+		myRfcs[i].hasChecksum = 0;
+		sprintf(filename, "RFC%d.txt", myRfcs[i].number);
+		fd = open(filename, O_RDONLY);
+		if (fd < 0)
+			continue;
+		crc = 0;
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			crc = crc32Update(crc, buf, len);
+		if (len == 0 && fstat(fd, &file_stat) == 0) {
+			myRfcs[i].hasChecksum = 1;
+			myRfcs[i].checksum = crc;
+			myRfcs[i].mtime = file_stat.st_mtime;
+			myRfcs[i].size = file_stat.st_size;
+			DEBUG("RFC %d has checksum %s%08x\n", myRfcs[i].number, CHECKSUM_PREFIX, crc);
+		}
+		close(fd);
+	}
+}
+
+// Remembers a hostname's address for RESOLVE_TTL seconds. A hinted
+// address is the one the server saw the peer register from, which behind
+// NAT or on a host with several interfaces may not be where it can be
+// reached, so it never replaces an address the resolver gave us.
+void rememberAddress(char* host, struct in_addr address, int hinted)
+{
+	resolvedHost *r;
+
+	for (r = resolvedHead; r != NULL; r = r->next) {
+		if (strcmp(r->hostname, host) == 0)
+			break;
+	}
+	if (r != NULL && hinted && !r->hinted && r->expires > time(NULL)) {
+		return;
+	}
+	if (r == NULL) {
+		if (strlen(host) >= LEN)
+			return;
+		r = (resolvedHost*)malloc(sizeof(resolvedHost));
+		if (r == NULL)
+			return;
+		strcpy(r->hostname, host);
+		r->next = resolvedHead;
+		resolvedHead = r;
+	}
+	r->address = address;
+	r->hinted = hinted;
+	r->expires = time(NULL) + RESOLVE_TTL;
+}
+
+// Drops a hostname's address, so the next connect asks the resolver
+void forgetAddress(char* host)
+{
+	resolvedHost **link;
+	resolvedHost *r;
+
+	for (link = &resolvedHead; *link != NULL; link = &(*link)->next) {
+		if (strcmp((*link)->hostname, host) == 0) {
+			r = *link;
+			*link = r->next;
+			free(r);
+			return;
+		}
+	}
+}
+
+// Finds a hostname's address, asking the resolver only if we have not
+// seen it in the last RESOLVE_TTL seconds. Every download from a peer
+// would otherwise cost a resolver round trip. Returns 0 if the host is
+// not found. If 'hinted' is given, it is set if the address is only a
+// hint from a LOOKUP row.
+int resolveHost(char* host, struct in_addr* address, int* hinted)
+{
+	resolvedHost *r;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	int rc;
+
+	for (r = resolvedHead; r != NULL; r = r->next) {
+		if (strcmp(r->hostname, host) == 0 && r->expires > time(NULL)) {
+			*address = r->address;
+			if (hinted != NULL)
+				*hinted = r->hinted;
+			return 1;
+		}
+	}
+
+	// getaddrinfo() rather than gethostbyname(), which is not thread-safe
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(host, NULL, &hints, &result);
+	if (rc != 0) {
+		fprintf(stderr, "Host not found (%s): %s\n", host, gai_strerror(rc));
+		return 0;
+	}
+	*address = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+	freeaddrinfo(result);
+	rememberAddress(host, *address, 0);
+	if (hinted != NULL)
+		*hinted = 0;
+	return 1;
+}
+
+// Milliseconds on a clock that never jumps, for upload and download
+// deadlines
+long long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int connectToAddress(struct in_addr address, int peerPort)
+{
+	int peerServerSocket;
+    struct sockaddr_in sinPeerServer;
+    int on=1;
+    int rc;
+
+    	memset(&sinPeerServer, 0, sizeof(sinPeerServer));
+    	sinPeerServer.sin_addr = address;
+    
+    	/* create and connect to a socket */
+    
+    	/* use address family INET and STREAMing sockets (TCP) */
+    	peerServerSocket = socket(AF_INET, SOCK_STREAM, 0);
+    	if ( peerServerSocket < 0 ) {
+        	perror("socket:");
+        	return -1;
+    	}
+    
+    	// The setsockopt() function is used so the local address
+    	// can be reused when the server is restarted before the required
+    	// wait time expires
+		if((rc = setsockopt(peerServerSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on))) < 0)
 		{
-			// When looking for title, it can have spaces, so do not
-			// add " " as a delimiter.
-			if (strcmp(tag, "Title:") == 0) {
-				s = strtok(0, "\n\r");
+			perror("setsockopt() error");
+			close(peerServerSocket);
+			return -1;
+		}
+
+    	// set up the address and port
+    	sinPeerServer.sin_family = AF_INET;
+    	sinPeerServer.sin_port = htons(peerPort);
+    
+    	// Start connecting, without waiting: a holder that does not answer
+    	// must not hold up the downloads from every other one. The caller
+    	// waits for the socket to become writable.
+    	setSocketBlockingEnabled(peerServerSocket, 0);
+    	rc = connect(peerServerSocket, (struct sockaddr *)&sinPeerServer, sizeof(sinPeerServer));
+    	if ( rc < 0 && errno != EINPROGRESS ) {
+        	perror("connect:");
+        	close(peerServerSocket);
+        	return -1;
+    	}
+    	return peerServerSocket;
+}
+
+// Sends one GET request. keepAlive asks the peer to leave the connection
+// open for the requests that follow. A slice other than the whole file is
+// asked for with a Range header giving its first and last byte.
+int sendGet(int peerServerSocket, int rfc, int fail, int keepAlive, slice* s)
+{
+    char request[BUF_SIZE];
+    char range[LEN];
+    int len;
+
+    	// And get the OS info
+		struct utsname osbuf;
+		uname(&osbuf);
+    
+    	range[0] = '\0';
+    	if (s != NULL && s->end >= 0) {
+    		sprintf(range, "Range: %lld-%lld\r\n", s->first, s->end - 1);
+    	}
+
+    	// set up the request
+    	len = sprintf(request, "%s RFC %d P2P-CI/1.0\r\nHost: %s\r\nOS: %s %s\r\n%s%s\r\n",
+    		fail ? "BLAH" : "GET", rfc, myHostname, osbuf.sysname, osbuf.release, range,
+    		keepAlive ? "Connection: keep-alive\r\n" : "");
+    	
+    	// Send the peer the GET request. MSG_NOSIGNAL: a peer that has
+    	// already closed must not kill us with SIGPIPE.
+    	if (sendAll(peerServerSocket, request, len, MSG_NOSIGNAL) < 0) {
+    		perror("send");
+    		return -1;
+    	}
+    	DEBUG("   Peer Client Sent:\n%s\n", request);
+    	return 0;
+}
+
+// Everything the scheduler is working on for one batch of fetches
+download *downloadHead = NULL;
+int downloadEpollFd;
+
+download* findDownload(holder* h)
+{
+	download *dl;
+
+	for (dl = downloadHead; dl != NULL; dl = dl->next) {
+		if (dl->port == h->port && strcmp(dl->hostname, h->hostname) == 0)
+			return dl;
+	}
+	dl = (download*)calloc(1, sizeof(download));
+	if (dl == NULL) {
+		printf("ERROR:  No memory for a download!\n");
+		return NULL;
+	}
+	strcpy(dl->hostname, h->hostname);
+	dl->port = h->port;
+	dl->socket = -1;
+	dl->next = downloadHead;
+	downloadHead = dl;
+	return dl;
+}
+
+int connectDownload(download* dl);
+
+// A connect to the address from a LOOKUP row failed. That address is
+// where the server saw the peer register from, which behind NAT or on a
+// host with several interfaces may not be where it can be reached, so it
+// is dropped and the resolver's answer is tried, once. Returns 0 if there
+// is nothing else to try.
+int retryByName(download* dl)
+{
+	struct in_addr hint = dl->address;
+
+	if (!dl->hinted)
+		return 0;
+	forgetAddress(dl->hostname);
+	if (!resolveHost(dl->hostname, &dl->address, &dl->hinted) || dl->address.s_addr == hint.s_addr)
+		return 0;
+	printf("Peer %s did not answer at its registered address, trying %s\n", dl->hostname, inet_ntoa(dl->address));
+	return connectDownload(dl);
+}
+
+// Starts connecting to a holder. finishConnect() sends the GETs queued
+// meanwhile once epoll says the socket is writable. Returns 0 if the
+// holder cannot be reached.
+int connectDownload(download* dl)
+{
+	struct epoll_event event;
+
+	if (!resolveHost(dl->hostname, &dl->address, &dl->hinted))
+		return 0;
+	dl->socket = connectToAddress(dl->address, dl->port);
+	if (dl->socket < 0)
+		return retryByName(dl);
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = dl;
+	if (epoll_ctl(downloadEpollFd, EPOLL_CTL_ADD, dl->socket, &event) < 0) {
+		perror("epoll_ctl");
+		close(dl->socket);
+		dl->socket = -1;
+		return 0;
+	}
+	dl->connecting = 1;
+	dl->deadline = nowMs() + PEER_TIMEOUT * 1000;
+	return 1;
+}
+
+// Adds a waiting slice of bytes first to end - 1 (or of the whole file,
+// if end is -1) to a fetch. It goes after the slice given, or first.
+slice* addSlice(fetch* f, slice* after, long long first, long long end)
+{
+	slice *s = (slice*)calloc(1, sizeof(slice));
+	if (s == NULL) {
+		printf("ERROR:  No memory for a download!\n");
+		return NULL;
+	}
+	s->f = f;
+	s->first = first;
+	s->end = end;
+	s->state = FETCH_WAITING;
+	if (after != NULL) {
+		s->next = after->next;
+		after->next = s;
+	}
+	else {
+		s->next = f->slices;
+		f->slices = s;
+	}
+	f->slicesLeft++;
+	return s;
+}
+
+// Ends a fetch. When ok, every slice is in and RFC<n>.txt.part becomes
+// RFC<n>.txt; it is only renamed once synced, so RFC<n>.txt is never half
+// a file (and we can safely download a file we are serving ourselves).
+// Otherwise the part file is thrown away.
+void endFetch(fetch* f, int ok)
+{
+	char filename[100];
+	char partname[110];
+
+	sprintf(filename, "RFC%d.txt", f->rfc);
+	sprintf(partname, "%s.part", filename);
+	if (f->fd < 0) {
+		f->state = FETCH_FAILED;
+		return;
+	}
+	if (ok && (fsync(f->fd) < 0 || close(f->fd) < 0)) {
+		perror("saving download");
+		ok = 0;
+		f->fd = -1;
+	}
+	if (f->fd >= 0 && !ok)
+		close(f->fd);
+	f->fd = -1;
+	if (ok && rename(partname, filename) < 0) {
+		perror("saving download");
+		ok = 0;
+	}
+	if (ok) {
+		DEBUG("   <saved %lld bytes as %s>\n", f->size, filename);
+		f->state = FETCH_DONE;
+	}
+	else {
+		unlink(partname);
+		f->state = FETCH_FAILED;
+	}
+}
+
+// Checks a fetch whose slices are all in against its checksum, if we know
+// it, by putting together the CRC-32 each slice got as it streamed in. A
+// whole file that fails goes back to waiting for another holder. A file in
+// slices cannot tell us which slice was bad, so it is fetched again whole,
+// from one holder after another until one sends a good copy. Returns 1 if
+// the file is good.
+int checkFetch(fetch* f)
+{
+	slice *s;
+	slice *next;
+	unsigned int crc = 0;
+
+	if (!f->hasChecksum)
+		return 1;
+	for (s = f->slices; s != NULL; s = s->next)
+		crc = crc32Combine(crc, s->crc, ((s->end >= 0) ? s->end : f->size) - s->first);
+	if (crc == f->checksum)
+		return 1;
+
+	printf("RFC %d failed its checksum (%s%08x, expected %s%08x)\n", f->rfc,
+		CHECKSUM_PREFIX, crc, CHECKSUM_PREFIX, f->checksum);
+	s = f->slices;
+	if (s->next == NULL) {
+		s->tried[s->current] = 1;
+	}
+	else {
+		while (s->next != NULL) {
+			next = s->next->next;
+			free(s->next);
+			s->next = next;
+		}
+		memset(s->tried, 0, sizeof(s->tried));
+		s->end = -1;
+	}
+	s->state = FETCH_WAITING;
+	f->slicesLeft = 1;
+	return 0;
+}
+
+// Takes the oldest slice off the connection's queue. A slice that failed
+// is marked so it is not asked of this holder again, and goes back to
+// waiting for another holder. The fetch is saved with its last slice.
+void finishSlice(download* dl, int ok)
+{
+	slice *s = dl->queue[dl->queueHead];
+	fetch *f = s->f;
+	dl->queueHead = (dl->queueHead + 1) % PEER_MAX_IN_FLIGHT;
+	dl->queueCount--;
+	dl->replies++;
+	if (ok) {
+		s->state = FETCH_DONE;
+		f->slicesLeft--;
+		if (f->slicesLeft == 0 && f->state == FETCH_ACTIVE && checkFetch(f))
+			endFetch(f, 1);
+	}
+	else {
+		s->tried[s->current] = 1;
+		s->state = FETCH_WAITING;
+	}
+}
+
+// Closes the connection. Slices still queued on it go back to waiting;
+// if the peer dropped us, it is not asked again in this batch.
+void closeDownload(download* dl, int dropped)
+{
+	while (dl->queueCount > 0) {
+		dl->queue[dl->queueHead]->state = FETCH_WAITING;
+		dl->queueHead = (dl->queueHead + 1) % PEER_MAX_IN_FLIGHT;
+		dl->queueCount--;
+	}
+	if (dl->socket >= 0) {
+		close(dl->socket); // also removes it from epoll
+	}
+	dl->connecting = 0;
+	if (dropped || dl->replies == 0) {
+		// A connection that got us nothing at all counts as dropped too,
+		// or we would keep reconnecting to it
+		printf("Peer %s:%d dropped the connection\n", dl->hostname, dl->port);
+		dl->dead = 1;
+	}
+	dl->socket = -1;
+	dl->state = DL_HEADER;
+	dl->start = dl->have = 0;
+	dl->replies = 0;
+}
+
+// Checks a reply's file size against what we know of the file. The first
+// reply for a fetch tells us the size: if it is a slice, the rest of the
+// file is split into more slices, which are then spread over the holders.
+// The part file is created here too. Returns 0 if the reply is not for
+// the same file as the others.
+int learnFileSize(slice* s, long long total)
+{
+	fetch *f = s->f;
+	char partname[110];
+	long long first;
+	slice *after;
+
+	if (f->size >= 0 || f->fd >= 0) {
+		// Another reply has already told us
+		return total == f->size;
+	}
+	f->size = total;
+	if (total < 0 || s->end < 0) {
+		// Sent whole, without a Range
+		s->end = -1;
+	}
+	else if (s->end >= total) {
+		s->end = total;
+	}
+	else {
+		// Slices are added in reverse so they end up in file order
+		after = s;
+		for (first = s->end + (total - s->end - 1) / SLICE_SIZE * SLICE_SIZE;
+				first >= s->end; first -= SLICE_SIZE) {
+			if (addSlice(f, after, first, (first + SLICE_SIZE < total) ? first + SLICE_SIZE : total) == NULL)
+				return 0;
+		}
+		DEBUG("   <RFC %d is %lld bytes, fetching it in %d slices>\n", f->rfc, total, f->slicesLeft);
+	}
+
+	sprintf(partname, "RFC%d.txt.part", f->rfc);
+	f->fd = open(partname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f->fd < 0) {
+		printf("Error creating file %s\n", partname);
+		return 0;
+	}
+	return 1;
+}
+
+// Writes the part of a reply body that falls inside the slice to where it
+// belongs in the file. A whole-file reply to a slice request (from a peer
+// that ignores Range) only gives us the bytes we asked for.
+int writeSlice(download* dl, slice* s, char* data, long long n)
+{
+	long long at = dl->offset + dl->received;
+	long long from = (at > s->first) ? at : s->first;
+	long long to = at + n;
+
+	if (s->end >= 0 && to > s->end)
+		to = s->end;
+	if (to <= from)
+		return 1;
+	s->crc = crc32Update(s->crc, &data[from - at], to - from);
+	return writeAll(s->f->fd, &data[from - at], to - from, from) >= 0;
+}
+
+// The body of the reply at the head of the queue is all in
+void endReplyBody(download* dl)
+{
+	slice *s = dl->queue[dl->queueHead];
+
+	if (dl->bodyOk && s->f->size < 0) {
+		// It was sent without a length, so now we know
+		s->f->size = dl->received;
+	}
+	dl->state = DL_HEADER;
+	finishSlice(dl, dl->bodyOk);
+}
+
+// Handles as much of the replies in the buffer as we can. Returns 0 once
+// it needs more data (or the connection was closed).
+int processDownloadBuffer(download* dl)
+{
+	char *header;
+	char *headerEnd;
+	char *status;
+	char *lengthStr;
+	char *rangeStr;
+	char *connection;
+	char *checksumStr;
+	long long n, first, last, total;
+	unsigned int checksum;
+	slice *s;
+	DEBUG2("processDownloadBuffer()\n");
+
+	if (dl->state == DL_HEADER) {
+		dl->buf[dl->have] = '\0';
+		headerEnd = strstr(&dl->buf[dl->start], "\r\n\r\n");
+		if (headerEnd == NULL) {
+			if (dl->start > 0) {
+				memmove(dl->buf, &dl->buf[dl->start], dl->have - dl->start);
+				dl->have -= dl->start;
+				dl->start = 0;
 			}
-			else {
-				s = strtok(0, " \n\r"); // the next token should be our value
+			if (dl->have == DOWNLOAD_BUF_SIZE) {
+				printf("Reply header is too long\n");
+				closeDownload(dl, 1);
 			}
-			DEBUG2("      found value - [%s]\n", s);
-			result = malloc(strlen(s) +1);
-			strcpy(result, s);
-			free(datacopy);
-			return result;
+			return 0;
+		}
+		if (dl->queueCount == 0) {
+			printf("Unexpected reply from %s:%d\n", dl->hostname, dl->port);
+			closeDownload(dl, 1);
+			return 0;
+		}
+		s = dl->queue[dl->queueHead];
+		header = &dl->buf[dl->start];
+		*headerEnd = '\0';
+		dl->start = headerEnd + 4 - dl->buf;
+		DEBUG("  Peer Client Received:\n%s\n\n", header);
+
+		status     = getTagVersion(header, 2);
+		lengthStr  = getTagValue(header, "Content-Length:");
+		rangeStr   = getTagValue(header, "Content-Range:");
+		checksumStr = getTagValue(header, "Checksum:");
+		connection = getTagValue(header, "Connection:");
+		dl->keepAlive = (connection != NULL && strcmp(connection, "keep-alive") == 0);
+		dl->length = (lengthStr != NULL) ? atoll(lengthStr) : -1;
+		free(connection);
+		free(lengthStr);
+
+		dl->bodyOk = 0;
+		if (status != NULL && strcmp(status, "200") == 0) {
+			// The whole file
+			dl->offset = 0;
+			dl->bodyOk = learnFileSize(s, dl->length);
+		}
+		else if (status != NULL && strcmp(status, "206") == 0) {
+			// Content-Range is "<first>-<last>/<file size>"
+			if (rangeStr != NULL && sscanf(rangeStr, "%lld-%lld/%lld", &first, &last, &total) == 3
+					&& first == s->first && dl->length == last - first + 1
+					&& learnFileSize(s, total) && last + 1 == s->end) {
+				dl->offset = first;
+				dl->bodyOk = 1;
+			}
+		}
+		else {
+			// An error reply has no file; try another holder
+			free(status);
+			free(rangeStr);
+			free(checksumStr);
+			finishSlice(dl, 0);
+			goto replyDone;
+		}
+		free(status);
+		free(rangeStr);
+
+		// A peer that sends the file's checksum tells us what to check it
+		// against, or, if it is not the one we expect, that it has some
+		// other file
+		if (parseChecksum(checksumStr, &checksum)) {
+			if (!s->f->hasChecksum) {
+				s->f->hasChecksum = 1;
+				s->f->checksum = checksum;
+			}
+			else if (checksum != s->f->checksum) {
+				dl->bodyOk = 0;
+			}
+		}
+		free(checksumStr);
+		s->crc = 0;
+
+		if (dl->length < 0) {
+			// Without a Content-Length the file ends when the peer closes
+			dl->keepAlive = 0;
+		}
+		// A reply we cannot use still has to be read past, but then fails
+		// over like a 404
+		if (!dl->bodyOk) {
+			printf("Bad reply for RFC %d from %s:%d\n", s->f->rfc, dl->hostname, dl->port);
+		}
+		dl->received = 0;
+		dl->state = DL_BODY;
+		return 1;
+	}
+	else {
+		// Body bytes go straight from the buffer to the file. Anything
+		// after the end of the body is the next reply.
+		s = dl->queue[dl->queueHead];
+		n = dl->have - dl->start;
+		if (dl->length >= 0 && n > dl->length - dl->received)
+			n = dl->length - dl->received;
+		if (dl->bodyOk && (s->f->state != FETCH_ACTIVE || !writeSlice(dl, s, &dl->buf[dl->start], n))) {
+			if (s->f->state == FETCH_ACTIVE)
+				perror("write");
+			dl->bodyOk = 0;
+		}
+		dl->start += n;
+		dl->received += n;
+		if (dl->start == dl->have) {
+			dl->start = dl->have = 0;
+		}
+		if (dl->length < 0 || dl->received < dl->length) {
+			return 0;
+		}
+		endReplyBody(dl);
+	}
+
+replyDone:
+	if (!dl->keepAlive) {
+		// That was the last reply the peer will send on this connection
+		closeDownload(dl, 0);
+		return 0;
+	}
+	return 1;
+}
+
+// Reads whatever the peer has sent us and handles every complete piece
+void readDownload(download* dl)
+{
+	int len;
+	DEBUG2("readDownload()\n");
+
+	while (dl->socket >= 0) {
+		while (processDownloadBuffer(dl))
+			;
+		if (dl->socket < 0)
+			return;
+		len = recv(dl->socket, &dl->buf[dl->have], DOWNLOAD_BUF_SIZE - dl->have, 0);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (len > 0) {
+			dl->deadline = nowMs() + PEER_TIMEOUT * 1000;
+		}
+		if (len <= 0) {
+			if (dl->state == DL_BODY && dl->length < 0) {
+				// The peer closing is the end of a file sent without a length
+				endReplyBody(dl);
+			}
+			// Otherwise the peer dropped us part way through
+			closeDownload(dl, dl->queueCount > 0);
+			return;
+		}
+		dl->have += len;
+	}
+}
+
+// The connection to a holder is up, or has failed. The GETs queued while
+// it was connecting are sent now.
+void finishConnect(download* dl)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	int i;
+
+	if (getsockopt(dl->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err != 0) {
+		printf("Could not connect to %s:%d: %s\n", dl->hostname, dl->port, strerror(err));
+		close(dl->socket);
+		dl->socket = -1;
+		if (!retryByName(dl))
+			closeDownload(dl, 1);
+		return;
+	}
+	dl->connecting = 0;
+	for (i = 0; i < dl->queueCount; i++) {
+		if (sendGet(dl->socket, dl->queue[(dl->queueHead + i) % PEER_MAX_IN_FLIGHT]->f->rfc, dl->fail, 1,
+				dl->queue[(dl->queueHead + i) % PEER_MAX_IN_FLIGHT]) < 0) {
+			closeDownload(dl, 1);
+			return;
+		}
+	}
+	dl->deadline = nowMs() + PEER_TIMEOUT * 1000;
+	readDownload(dl);
+}
+
+// Asks a holder for a waiting slice. Of the holders that have not failed
+// this slice yet, we pick the one with the fewest GETs outstanding, so a
+// batch is spread over every peer that has the RFCs. Returns 0 if every
+// usable holder is busy, so the slice must wait.
+int startSlice(slice* s, int fail)
+{
+	fetch *f = s->f;
+	download *dl;
+	download *best;
+	int i, bestIndex;
+
+	while (1) {
+		best = NULL;
+		bestIndex = -1;
+		for (i = 0; i < f->holderCount; i++) {
+			if (s->tried[i])
+				continue;
+			dl = findDownload(&f->holders[i]);
+			if (dl == NULL || dl->dead)
+				continue;
+			if (best == NULL || dl->queueCount < best->queueCount) {
+				best = dl;
+				bestIndex = i;
+			}
+		}
+		if (best == NULL) {
+			// Without this slice there is no file
+			printf("No peer could give us RFC %d\n", f->rfc);
+			s->state = FETCH_FAILED;
+			endFetch(f, 0);
+			return 1;
+		}
+		if (best->queueCount == PEER_MAX_IN_FLIGHT) {
+			return 0;
+		}
+
+		if (best->socket < 0 && !connectDownload(best)) {
+			best->dead = 1;
+			continue;
+		}
+		best->fail = fail;
+
+		// We close the connection ourselves once we are done with a peer,
+		// so every GET asks for keep-alive. Until the connection is up the
+		// GET just waits in the queue.
+		if (!best->connecting && sendGet(best->socket, f->rfc, fail, 1, s) < 0) {
+			closeDownload(best, 1);
+			continue;
+		}
+		if (best->queueCount == 0 && !best->connecting) {
+			best->deadline = nowMs() + PEER_TIMEOUT * 1000;
+		}
+		best->queue[(best->queueHead + best->queueCount) % PEER_MAX_IN_FLIGHT] = s;
+		best->queueCount++;
+		s->current = bestIndex;
+		s->state = FETCH_ACTIVE;
+		return 1;
+	}
+}
+
+// Downloads a batch of RFCs, each from any of its holders. Every peer
+// gets one connection with up to PEER_MAX_IN_FLIGHT GETs pipelined on it,
+// and all the connections are served from one epoll loop, so the batch
+// downloads from all the peers at once. An RFC that several peers have is
+// fetched in slices, each from whichever of them is least busy, and the
+// slices are written into place in one file. A slice that gets a 404, or
+// whose peer drops the connection or sends nothing for PEER_TIMEOUT
+// seconds, moves on to another holder.
+void runFetches(fetch* fetches, int count, int fail)
+{
+	struct epoll_event events[MAX_DOWNLOAD_EVENTS];
+	download *dl;
+	fetch *f;
+	slice *s;
+	int i, result, active, timeout;
+	long long now;
+	DEBUG2("runFetches()\n");
+
+	downloadEpollFd = epoll_create1(0);
+	if (downloadEpollFd < 0) {
+		perror("epoll_create1");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		f = &fetches[i];
+		f->size = -1;
+		f->fd = -1;
+		f->state = FETCH_ACTIVE;
+		// A file only one peer has is asked for whole. Otherwise we ask for
+		// its first slice, and the reply tells us how many more there are.
+		if (addSlice(f, NULL, 0, (f->holderCount > 1) ? SLICE_SIZE : -1) == NULL)
+			f->state = FETCH_FAILED;
+	}
+
+	while (1) {
+		// A holder that has stopped answering is given up on, and its
+		// slices go back to waiting for another
+		now = nowMs();
+		for (dl = downloadHead; dl != NULL; dl = dl->next) {
+			if (dl->socket >= 0 && dl->queueCount > 0 && dl->deadline <= now) {
+				printf("Peer %s:%d timed out\n", dl->hostname, dl->port);
+				closeDownload(dl, 1);
+			}
+		}
+
+		active = 0;
+		for (i = 0; i < count; i++) {
+			f = &fetches[i];
+			for (s = f->slices; s != NULL; s = s->next) {
+				if (s->state == FETCH_WAITING && f->state == FETCH_ACTIVE)
+					startSlice(s, fail);
+				if (s->state == FETCH_ACTIVE)
+					active++;
+			}
+		}
+		if (active == 0) {
+			// Nothing busy means nothing can be waiting on a busy holder
+			break;
+		}
+
+		// Done with a peer once it has nothing left to send us
+		for (dl = downloadHead; dl != NULL; dl = dl->next) {
+			if (dl->socket >= 0 && dl->queueCount == 0)
+				closeDownload(dl, 0);
+		}
+
+		// Wake up in time for the first deadline
+		timeout = -1;
+		now = nowMs();
+		for (dl = downloadHead; dl != NULL; dl = dl->next) {
+			if (dl->socket >= 0 && dl->queueCount > 0 && (timeout < 0 || dl->deadline - now < timeout))
+				timeout = (dl->deadline > now) ? (int)(dl->deadline - now) : 0;
+		}
+
+		result = epoll_wait(downloadEpollFd, events, MAX_DOWNLOAD_EVENTS, timeout);
+		if (result < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < result; i++) {
+			dl = (download*)events[i].data.ptr;
+			if (dl->connecting)
+				finishConnect(dl);
+			else
+				readDownload(dl);
+		}
+	}
+
+	while (downloadHead != NULL) {
+		dl = downloadHead;
+		downloadHead = dl->next;
+		if (dl->socket >= 0)
+			closeDownload(dl, 0);
+		free(dl);
+	}
+	for (i = 0; i < count; i++) {
+		f = &fetches[i];
+		if (f->state == FETCH_ACTIVE)
+			endFetch(f, 0);
+		while (f->slices != NULL) {
+			s = f->slices;
+			f->slices = s->next;
+			free(s);
+		}
+	}
+	close(downloadEpollFd);
+}
+
+// Downloads a list of RFCs from one peer, over one connection
+void getRfcs(int* rfcs, int count, char* host, int peerPort, int fail)
+{
+	fetch *fetches;
+	int i;
+	DEBUG2("getRfcs()\n");
+
+	fetches = (fetch*)calloc(count, sizeof(fetch));
+	if (fetches == NULL) {
+		printf("ERROR:  No memory for a download!\n");
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		fetches[i].rfc = rfcs[i];
+		strcpy(fetches[i].holders[0].hostname, host);
+		fetches[i].holders[0].port = peerPort;
+		fetches[i].holderCount = 1;
+	}
+	runFetches(fetches, count, fail);
+	free(fetches);
+}
+
+// For test purposes, this function will take as the last parameter
+//    int fail - If 1, this will purposefully send an invalid command
+//             - If 0, it will request the rfc as designed
+void getRfc(int rfc, char* host, int peerPort, int fail)
+{
+	// Connect to another peer and send the GET command,
+	// then receive the response
+	DEBUG2("getRfc()\n");
+	getRfcs(&rfc, 1, host, peerPort, fail);
+}
+
+// Server replies end with a blank line. Receives until 'count' complete
+// replies have arrived and returns them in one malloc'd, NUL terminated buffer.
+char* recvResponses(int serverSocket, int count)
+{
+	int cap = BUF_SIZE;
+	int len = 0;
+	int found = 0;
+	int scanned = 0;
+	int n;
+	char *buf = malloc(cap);
+	char *p;
+	DEBUG2("recvResponses() - %d\n", count);
+
+	while (buf != NULL && found < count)
+	{
+		if (cap - len < BUF_SIZE / 2) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			if (buf == NULL)
+				break;
+		}
+		n = recv(serverSocket, &buf[len], cap - len - 1, 0);
+		if (n <= 0) {
+			perror("recv");
+			break;
+		}
+		len += n;
+		buf[len] = '\0';
+
+		// Count the replies that are now complete
+		while ((p = strstr(&buf[scanned], "\r\n\r\n")) != NULL) {
+			found++;
+			scanned = (p - buf) + 4;
 		}
-		s = strtok(0, " \n\r");
 	}
-	free(datacopy);
-	
-	return result;
+	return buf;
 }
 
-char* getTagVersion(char *data, int versionPosition)
+// Fills in a fetch from one LOOKUP reply. Each row is
+// "RFC <number> <title> <hostname> <port>", with " crc32:<checksum>" after
+// it if the peer registered one and " addr:<address>" if the server sends
+// the peer's address. The title may have spaces, so we work back from the
+// end of the row. The first checksum listed is the one the file is checked
+// against; a peer that registered a different one has some other file, so
+// it is left out. Addresses are remembered, so downloading from the peer
+// needs no name lookup.
+void parseLookupRows(char *reply, fetch* f)
 {
-	char *datacopy = malloc(strlen(data) + 1); // strtok modifies the string
-	char *version;
-	char *result = 0;
-	DEBUG2("getTagVersion() - version at %d\n", versionPosition);
-	
-	strcpy(datacopy, data);
-	
-	version = strtok(datacopy, " \r\n");
-	versionPosition--;
-	
-	// we know the version is the nth token position based on
-	// versionPosition passed in
-	while (versionPosition)
-	{
-		version = strtok(0, " \r\n");
-		versionPosition--;
+	char *line, *end, *port, *host, *word;
+	char row[BUF_SIZE];
+	unsigned int checksum;
+	struct in_addr address;
+	int len, hasChecksum, hasAddress;
+
+	for (line = reply; *line != '\0'; line = end) {
+		end = strstr(line, "\r\n");
+		if (end == NULL)
+			break;
+		len = end - line;
+		end += 2;
+		if (len == 0 || len >= sizeof(row) || strncmp(line, "RFC ", 4) != 0)
+			continue;
+		memcpy(row, line, len);
+		row[len] = '\0';
+
+		word = strrchr(row, ' ');
+		hasAddress = (word != NULL && strncmp(word + 1, ADDRESS_PREFIX, strlen(ADDRESS_PREFIX)) == 0
+			&& inet_pton(AF_INET, word + 1 + strlen(ADDRESS_PREFIX), &address) == 1);
+		if (hasAddress) {
+			*word = '\0';
+			word = strrchr(row, ' ');
+		}
+		hasChecksum = (word != NULL && parseChecksum(word + 1, &checksum));
+		if (hasChecksum) {
+			*word = '\0';
+			if (!f->hasChecksum) {
+				f->hasChecksum = 1;
+				f->checksum = checksum;
+			}
+			else if (checksum != f->checksum) {
+				continue;
+			}
+		}
+
+		port = strrchr(row, ' ');
+		if (port == NULL)
+			continue;
+		*port++ = '\0';
+		host = strrchr(row, ' ');
+		if (host == NULL || strlen(host + 1) >= LEN)
+			continue;
+		host++;
+		if (hasAddress) {
+			rememberAddress(host, address, 1);
+		}
+		if (f->holderCount < MAX_HOLDERS) {
+			strcpy(f->holders[f->holderCount].hostname, host);
+			f->holders[f->holderCount].port = atoi(port);
+			f->holderCount++;
+		}
 	}
-	
-	result = malloc(strlen(version) + 1);
-	strcpy(result, version);
-	free(datacopy);
-	
-	return result;
 }
 
-char *replaceMask(char *command, char *orig, char *rep)
+// Downloads a batch of RFCs from whichever peers have them. The LOOKUPs
+// all go to the server at once, then every row of every reply is used, so
+// the downloads are shared out over all the holders.
+void downloadRfcs(int serverSocket, int* rfcs, int count)
 {
-	static char buffer[4096];
-	char *p;
+	fetch *fetches;
+	char *request;
+	char *replies;
+	char *reply;
+	char *end;
+	int i, len;
+	DEBUG2("downloadRfcs()\n");
 
-	if(!(p = strstr(command, orig))) {
-		return command;
+	fetches = (fetch*)calloc(count, sizeof(fetch));
+	request = malloc(count * (LEN + 64) + 1);
+	if (fetches == NULL || request == NULL) {
+		printf("ERROR:  No memory for a download!\n");
+		free(fetches);
+		free(request);
+		return;
 	}
 
-	strncpy(buffer, command, p - command); // Copy characters from 'str' start to 'orig'
-	buffer[p - command] = '\0';
+	len = 0;
+	for (i = 0; i < count; i++) {
+		len += sprintf(&request[len], "LOOKUP RFC %d P2P-CI/1.0\n\rHost: %s\n\r\n\r", rfcs[i], myHostname);
+	}
+	if (sendAll(serverSocket, request, len, 0) < 0) {
+		perror("send");
+		exit(1);
+	}
+	free(request);
 
-	sprintf(buffer + (p - command), "%s%s", rep, p + strlen(orig));
+	// The replies come back in the order we asked
+	replies = recvResponses(serverSocket, count);
+	reply = replies;
+	for (i = 0; i < count; i++) {
+		fetches[i].rfc = rfcs[i];
+		if (reply == NULL || (end = strstr(reply, "\r\n\r\n")) == NULL)
+			continue;
+		end[2] = '\0';
+		parseLookupRows(reply, &fetches[i]);
+		DEBUG("RFC %d is held by %d peers\n", rfcs[i], fetches[i].holderCount);
+		reply = end + 4;
+	}
+	free(replies);
 
-	return buffer;
+	runFetches(fetches, count, 0);
+	free(fetches);
 }
 
-// For test purposes, this function will take as the last parameter
-//    int fail - If 1, this will purposefully send an invalid command
-//             - If 0, it will request the rfc as designed
-void getRfc(int rfc, char* host, int peerPort, int fail)
+// Sends one finished BULKADD request
+void sendBatch(int serverSocket, char *batch, int len)
 {
-	// Connect to another peer and send the GET command,
-	// then receive the response
-	DEBUG2("getRfc()\n");
-	int peerServerSocket;
-    struct hostent *pHostentPeerServer;
-    struct sockaddr_in sinPeerServer;
-    int on=1;
-    int rc;
-    int len;
-    char rfcString[10];
-    char request[BUF_SIZE];
-    char response[BUF_SIZE];
-    memset(&request, 0, sizeof(request));
-    memset(&response, 0, sizeof(response));
+	int i, sent;
 
-    	pHostentPeerServer = gethostbyname(host); 
-    	if ( pHostentPeerServer == NULL ) {
-        	fprintf(stderr, "Host not found (%s)\n", host);
-        	exit(1);
-    	}
-    
-    	/* create and connect to a socket */
-    
-    	/* use address family INET and STREAMing sockets (TCP) */
-    	peerServerSocket = socket(AF_INET, SOCK_STREAM, 0);
-    	if ( peerServerSocket < 0 ) {
-        	perror("socket:");
-        	exit(peerServerSocket);
-    	}
-    
-    	// The setsockopt() function is used so the local address
-    	// can be reused when the server is restarted before the required
-    	// wait time expires
-		if((rc = setsockopt(peerServerSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on))) < 0)
-		{
-			perror("setsockopt() error");
-			close(peerServerSocket);
-			exit (-1);
+	for (sent = 0; sent < len; sent += i) {
+		i = send(serverSocket, &batch[sent], len - sent, 0);
+		if (i <= 0) {
+			perror("send");
+			exit(1);
 		}
+	}
+}
 
-    	// set up the address and port
-    	sinPeerServer.sin_family = AF_INET;
-    	sinPeerServer.sin_port = htons(peerPort);
-    	memcpy(&sinPeerServer.sin_addr, pHostentPeerServer->h_addr_list[0], pHostentPeerServer->h_length);
-    
-    	// connect to socket at above addr and port
-    	rc = connect(peerServerSocket, (struct sockaddr *)&sinPeerServer, sizeof(sinPeerServer));
-    	if ( rc < 0 ) {
-        	perror("connect:");
-        	exit(rc);
-    	}
-    	
-    	// And get the OS info
-		struct utsname osbuf;
-		uname(&osbuf);
-    
-    	// set up the request
-    	sprintf(rfcString, "%d", rfc);
-    	if (fail) { strcpy(request, "BLAH RFC "); }
-    	else {      strcpy(request, "GET RFC "); }
-    	strcat(request, rfcString);
-    	strcat(request, " P2P-CI/1.0\r\nHost: ");
-    	strcat(request, myHostname);
-    	strcat(request, "\r\nOS: ");
-		strcat(request, osbuf.sysname);
-		strcat(request, " ");
-		strcat(request, osbuf.release);
-		strcat(request, "\r\n\r\n");
-    	
-    	// Send the server the GET request
-    	len = send(peerServerSocket, request, strlen(request), 0);
-    	if (len != strlen(request)) {
-    		perror("send");
-    		exit(1);
-    	}
-    	DEBUG("   Peer Client Sent:\n%s\n", request);
-    	
-    	// Wait for response
-    	len = recv(peerServerSocket, response, sizeof(response)-1, 0);
-    	if (len < 0) {
-    		perror("recv:");
-    	}
-    	DEBUG("  Peer Client Received:\n%s\n", response);
-    	
-    	sleep(1);
-    	close(peerServerSocket);
+// Registers every RFC in myRfcs with BULKADD requests. The server adds
+// each batch in one pass and sends back one summary reply for it, so
+// registration costs a single round trip however many RFCs we have: the
+// batches are all sent before any reply is read. A catalog bigger than
+// BULKADD_BATCH_SIZE is split so no request goes over the server's limit.
+void addMyRfcs(int serverSocket, char *portStr)
+{
+	DEBUG2("addMyRfcs()\n");
+	int i, len, start;
+	int batches = 0;
+	char *batch;
+	char *replies;
+
+	batch = malloc(BULKADD_BATCH_SIZE);
+	if (batch == NULL) {
+		printf("Out of memory building BULKADD request\n");
+		exit(1);
+	}
+
+	DEBUG("\n------------------------------------\n");
+	DEBUG("Sending BULKADD commands for %d RFCs\n", myRfcCount);
+	i = 0;
+	do {
+		len = sprintf(batch, "BULKADD ALL P2P-CI/1.0\n\rHost: %s\n\rPort: %s\n\r", myHostname, portStr);
+		start = i;
+		// Room for a row at its longest and the blank line ending the request.
+		// Every batch takes at least one row, so the loop always gets
+		// through the catalog; a title is far shorter than a batch.
+		for (; i < myRfcCount && (i == start || len + strlen(myRfcs[i].title) + 64 < BULKADD_BATCH_SIZE); i++) {
+			len += sprintf(&batch[len], "RFC %d %s", myRfcs[i].number, myRfcs[i].title);
+			if (myRfcs[i].hasChecksum) {
+				len += sprintf(&batch[len], " %s%08x", CHECKSUM_PREFIX, myRfcs[i].checksum);
+			}
+			len += sprintf(&batch[len], "\n\r");
+		}
+		len += sprintf(&batch[len], "\n\r");
+		sendBatch(serverSocket, batch, len);
+		batches++;
+		DEBUG("Sent BULKADD for RFCs %d to %d\n", start, i - 1);
+	} while (i < myRfcCount);
+	free(batch);
+
+	// Wait for an Ack to each batch
+	replies = recvResponses(serverSocket, batches);
+	DEBUG("Received from Server:\n%s\n", replies ? replies : "");
+	DEBUG("\n------------------------------------\n");
+	free(replies);
 }
 
 // Here we are just going to throw some commands at the server
@@ -324,8 +1562,9 @@ void getRfc(int rfc, char* host, int peerPort, int fail)
 // header field name <sp> value <cr> <lf>
 // <cr> <lf>
 //
-// There are three methods:
+// There are four methods:
 // • ADD, to add a locally available RFC to the server’s index,
+// • BULKADD, to add many locally available RFCs in one request,
 // • LOOKUP, to find peers that have the specified RFC, and
 // • LIST, to request the whole index of RFCs from the server.
 // Also, three header fields are defined:
@@ -338,68 +1577,23 @@ void callServerCommands(int serverSocket, int port)
 	DEBUG2("callServerCommands()\n");
 	int len;
 	char portStr[5]; // string of my port to include in commands to server
-	char buf[BUF_SIZE];
-	char *peerHostStr; // used to hold host of peer we will connect to get rfc from
-	char *peerPortStr; // used to hold port of peer we will connect to get rfc from
-	int peerPort;      // used to hold port of peer we will connect to get rfc from
+	char *reply;
+	fetch found;       // peers listed by the LOOKUP reply
 	sprintf(portStr, "%d", port);
-	memset(&buf, 0, sizeof(buf));
 	
 	DEBUG("\n^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n");
 	DEBUG("Peer sending P2S commands to Server\n");
 	
 	//
-	// Send ADD command
-	//
-	DEBUG("\n------------------------------------\n");
-	DEBUG("Sending valid ADD command\n");
-	char addCommand[BUF_SIZE];
-	strcpy(addCommand, "ADD RFC 123 P2P-CI/1.0\n\rHost: ");
-	strcat(addCommand, myHostname);
-	strcat(addCommand, "\n\rPort: ");
-	strcat(addCommand, portStr);
-	strcat(addCommand, "\n\rTitle: A test rfc\n\r\n\r");
-	
-	len = send(serverSocket, addCommand, strlen(addCommand), 0);
-	if (len != strlen(addCommand)) {
-    	perror("send");
-    	exit(1);
-    }
-    DEBUG("Sent command to Server:\n%s\n", addCommand);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
-	DEBUG("\n------------------------------------\n");
-    
-	//
-	// Send 2nd ADD command
+	// Send ADD commands for all of our RFCs
 	//
-	DEBUG("\n------------------------------------\n");
-	DEBUG("Sending valid ADD command\n");
-	char addCommand2[BUF_SIZE];
-	strcpy(addCommand2, "ADD RFC 456 P2P-CI/1.0\n\rHost: ");
-	strcat(addCommand2, myHostname);
-	strcat(addCommand2, "\n\rPort: ");
-	strcat(addCommand2, portStr);
-	strcat(addCommand2, "\n\rTitle: Just another rfc\n\r\n\r");
-	
-	len = send(serverSocket, addCommand2, strlen(addCommand2), 0);
-	if (len != strlen(addCommand2)) {
-    	perror("send");
-    	exit(1);
-    }
-    DEBUG("Sent command to Server:\n%s\n", addCommand2);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
-	DEBUG("\n------------------------------------\n");
+	addMyRfcs(serverSocket, portStr);
     
     //
     // Send LOOKUP command
     //
 	DEBUG("\n------------------------------------\n");
 	DEBUG("Sending valid LOOKUP command\n");
-	memset(&buf, 0, sizeof(buf));
     char lookupCommand[BUF_SIZE];
 	strcpy(lookupCommand, "LOOKUP RFC 123 P2P-CI/1.0\n\rHost: ");
 	strcat(lookupCommand, myHostname);
@@ -413,26 +1607,29 @@ void callServerCommands(int serverSocket, int port)
     	exit(1);
     }
     DEBUG("Sent command to Server:\n%s\n", lookupCommand);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
+    // Wait for the whole reply, which ends with a blank line
+	reply = recvResponses(serverSocket, 1);
+	DEBUG("Received from Server:\n%s\n", reply ? reply : "");
 	DEBUG("\n------------------------------------\n");
 	
-	// Read host/port from response and save for call to getRfc
-	peerHostStr = getHostValueFromLookup(&buf);  DEBUG2("   Host = %s\n", peerHostStr);
-	peerPortStr = getPortValueFromLookup(&buf);  DEBUG2("   Port = %s\n", peerPortStr);
-	strcpy(peerHostForRFC, peerHostStr);
-	peerPortForRFC = atoi(peerPortStr);
+	// Read host/port from response and save for call to getRfc. We use the
+	// last peer listed.
+	memset(&found, 0, sizeof(found));
+	if (reply != NULL)
+		parseLookupRows(reply, &found);
+	free(reply);
+	if (found.holderCount > 0) {
+		strcpy(peerHostForRFC, found.holders[found.holderCount - 1].hostname);
+		peerPortForRFC = found.holders[found.holderCount - 1].port;
+	}
+	DEBUG2("   Host = %s\n   Port = %d\n", peerHostForRFC, peerPortForRFC);
 
-	sleep(1);
-	
 	    
     //
     // Send LOOKUP command with BAD VERSION
     //
 	DEBUG("\n------------------------------------\n");
 	DEBUG("Sending valid LOOKUP command with BAD VERSION\n");
-	memset(&buf, 0, sizeof(buf));
     char badVersionCommand[BUF_SIZE];
 	strcpy(badVersionCommand, "LOOKUP RFC 123 P2P-CI/2.0\n\rHost: ");
 	strcat(badVersionCommand, myHostname);
@@ -446,20 +1643,18 @@ void callServerCommands(int serverSocket, int port)
     	exit(1);
     }
     DEBUG("Sent command to Server:\n%s\n", badVersionCommand);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
+    // Wait for the whole reply, which ends with a blank line
+	reply = recvResponses(serverSocket, 1);
+	DEBUG("Received from Server:\n%s\n", reply ? reply : "");
+	free(reply);
 	DEBUG("\n------------------------------------\n");
 	
-	sleep(1);
-	
 	    
     //
     // Send LOOKUP command with RFC that does not exist
     //
 	DEBUG("\n------------------------------------\n");
 	DEBUG("Sending valid LOOKUP command with RFC that does not exist\n");
-	memset(&buf, 0, sizeof(buf));
     char badRfcCommand[BUF_SIZE];
 	strcpy(badRfcCommand, "LOOKUP RFC 999 P2P-CI/1.0\n\rHost: ");
 	strcat(badRfcCommand, myHostname);
@@ -473,9 +1668,10 @@ void callServerCommands(int serverSocket, int port)
     	exit(1);
     }
     DEBUG("Sent command to Server:\n%s\n", badRfcCommand);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
+    // Wait for the whole reply, which ends with a blank line
+	reply = recvResponses(serverSocket, 1);
+	DEBUG("Received from Server:\n%s\n", reply ? reply : "");
+	free(reply);
 	DEBUG("\n------------------------------------\n");
 	
 		
@@ -484,7 +1680,6 @@ void callServerCommands(int serverSocket, int port)
     //
 	DEBUG("\n------------------------------------\n");
 	DEBUG("Sending valid LIST command\n");
-	memset(&buf, 0, sizeof(buf));
     char listCommand[BUF_SIZE];
 	strcpy(listCommand, "LIST ALL P2P-CI/1.0\n\rHost: ");
 	strcat(listCommand, myHostname);
@@ -498,16 +1693,16 @@ void callServerCommands(int serverSocket, int port)
     	exit(1);
     }
     DEBUG("Sent command to Server:\n%s\n", listCommand);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
+    // Wait for the whole reply, which ends with a blank line
+	reply = recvResponses(serverSocket, 1);
+	DEBUG("Received from Server:\n%s\n", reply ? reply : "");
+	free(reply);
 	DEBUG("\n------------------------------------\n");
 	
 	//
 	// Send Invalid command
 	DEBUG("\n------------------------------------\n");
 	DEBUG("Sending Invalid command\n");
-	memset(&buf, 0, sizeof(buf));
     char invalidCommand[BUF_SIZE];
 	strcpy(invalidCommand, "BLAH ALL P2P-CI/1.0\n\rHost: ");
 	strcat(invalidCommand, myHostname);
@@ -521,9 +1716,10 @@ void callServerCommands(int serverSocket, int port)
     	exit(1);
     }
     DEBUG("Sent command to Server:\n%s\n", invalidCommand);
-    // Wait for Ack
-	recv(serverSocket, buf, sizeof(buf)-1, 0);
-	DEBUG("Received from Server:\n%s\n", buf);
+    // Wait for the whole reply, which ends with a blank line
+	reply = recvResponses(serverSocket, 1);
+	DEBUG("Received from Server:\n%s\n", reply ? reply : "");
+	free(reply);
 	DEBUG("\n------------------------------------\n");
 	
 	DEBUG("^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n\n");
@@ -546,6 +1742,14 @@ void callPeerCommands(int serverSocket)
 	DEBUG("Peer Client sending Invalid command\n");
 	getRfc(123, peerHostForRFC, peerPortForRFC, 1);
 	DEBUG("\n------------------------------------\n");
+	DEBUG("Peer Client sending pipelined GET requests on one connection\n");
+	int someRfcs[] = { 123, 999, 123 };
+	getRfcs(someRfcs, 3, peerHostForRFC, peerPortForRFC, 0);
+	DEBUG("\n------------------------------------\n");
+	DEBUG("Peer Client downloading RFCs from every peer that has them\n");
+	int wantedRfcs[] = { 123, 234, 456 };
+	downloadRfcs(serverSocket, wantedRfcs, 3);
+	DEBUG("\n------------------------------------\n");
 	DEBUG("xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\n");
 	
 	
@@ -566,88 +1770,117 @@ int isVersionOk(char *version) {
 	}
 }
 
-void send400(int peerSocket) {
+void send400(upload* up) {
 	DEBUG2("send400()\n");
-	char message[] = "P2P-CI/1.0 400 Bad Request\r\n\r\n";
+	char message[] = "P2P-CI/1.0 400 Bad Request\r\n";
 	
-	send(peerSocket, message, strlen(message), 0);
+	up->replyLen = sprintf(up->reply, "%s%s\r\n", message,
+		up->keepAlive ? "Connection: keep-alive\r\n" : "");
 }
 
-void send404(int peerSocket) {
+void send404(upload* up) {
 	DEBUG2("send404()\n");
-	char message[] = "P2P-CI/1.0 404 P2P-CI Not Found\r\n\r\n";
+	char message[] = "P2P-CI/1.0 404 P2P-CI Not Found\r\n";
+	
+	up->replyLen = sprintf(up->reply, "%s%s\r\n", message,
+		up->keepAlive ? "Connection: keep-alive\r\n" : "");
+}
+
+void send416(upload* up) {
+	DEBUG2("send416()\n");
+	char message[] = "P2P-CI/1.0 416 Range Not Satisfiable\r\n";
+	
+	up->replyLen = sprintf(up->reply, "%s%s\r\n", message,
+		up->keepAlive ? "Connection: keep-alive\r\n" : "");
+}
+
+void send500(upload* up) {
+	DEBUG2("send500()\n");
+	char message[] = "P2P-CI/1.0 500 Internal Server Error\r\n";
 	
-	send(peerSocket, message, strlen(message), 0);
+	up->replyLen = sprintf(up->reply, "%s%s\r\n", message,
+		up->keepAlive ? "Connection: keep-alive\r\n" : "");
 }
 
-void send505(int peerSocket) {
+void send505(upload* up) {
 	DEBUG2("send505()\n");
-	char message[] = "P2P-CI/1.0 505 P2P-CI Version Not Supported\r\n\r\n";
+	char message[] = "P2P-CI/1.0 505 P2P-CI Version Not Supported\r\n";
 	
-	send(peerSocket, message, strlen(message), 0);
+	up->replyLen = sprintf(up->reply, "%s%s\r\n", message,
+		up->keepAlive ? "Connection: keep-alive\r\n" : "");
 }
 
-void handlePeerDownload(int peerSocket)
+// Works out the reply to the GET request in up->request. For a valid
+// request this opens the file and builds the reply header; the file itself
+// is sent later by sendDownloadReply().
+void handlePeerDownload(upload* up)
 {
 	DEBUG2("handlePeerDownload()\n");
-	char buf[256];
-	memset(&buf, 0, sizeof(buf));
+	char *buf = up->request;
 	int rfcNum;
 	char *rfcNumString;
 	char *host;
 	char *version;
 	char *os;
+	char *connection;
+	char *range;
 	char filename[100];
-	char reply[BUF_SIZE];
-	int fd;
-	FILE *fp;
+	char contentRange[96];  // "Content-Range: f-l/total"
+	char checksum[48];      // "Checksum: crc32:<8 hex digits>"
+	int i, fd;
 	struct stat file_stat;
-	int offset, bytesRemaining;
-	int len;
-	char fileSize[200];
 	time_t modifiedTime;
-	memset(&reply, 0, sizeof(reply));
+	long long first, last;
 
-	// Get the download request
-	recv(peerSocket, buf, sizeof(buf)-1, 0);
 	DEBUG("===============================\n");
 	DEBUG("Peer Server Received:\n%s\n", buf);
 	
 	// Check the command that was sent
+	up->keepAlive = 0;
 	if (buf[0] != 'G' || buf[1] != 'E' || buf[2] != 'T') {
-		// Invalid command
-		send400(peerSocket);
+		// Invalid command. Close afterwards, as there is no telling
+		// where the next request would start.
+		send400(up);
 		return;
 	}
 	
-	rfcNumString = getTagValue(&buf, "RFC");    DEBUG2("   RFC = %s\n", rfcNumString);
-	version      = getTagVersion(&buf, 4);      DEBUG2("   Version = %s\n", version);
-	host         = getTagValue(&buf, "Host:");  DEBUG2("   Host = %s\n", host);
-	os           = getTagValue(&buf, "OS:");    DEBUG2("   OS = %s\n", os);
+	rfcNumString = getTagValue(buf, "RFC");    DEBUG2("   RFC = %s\n", rfcNumString);
+	version      = getTagVersion(buf, 4);      DEBUG2("   Version = %s\n", version);
+	host         = getTagValue(buf, "Host:");  DEBUG2("   Host = %s\n", host);
+	os           = getTagValue(buf, "OS:");    DEBUG2("   OS = %s\n", os);
+	connection   = getTagValue(buf, "Connection:");
+	free(host);
+	free(os);
+	// A downloader fetching several RFCs asks to keep the connection open
+	// and may send its next GETs before this reply is done
+	up->keepAlive = (connection != NULL && strcmp(connection, "keep-alive") == 0);
+	free(connection);
+	if (rfcNumString == NULL || version == NULL) {
+		free(rfcNumString);
+		free(version);
+		send400(up);
+		return;
+	}
 	rfcNum = atoi(rfcNumString);
+	free(rfcNumString);
 
 	// Check version
 	if (!isVersionOk(version)) {
-		send505(peerSocket);
+		free(version);
+		send505(up);
 		return;
 	}
+	free(version);
 	
-	strcpy(filename, "RFC");
-	strcat(filename, rfcNumString);
-	strcat(filename, ".txt");
+	sprintf(filename, "RFC%d.txt", rfcNum);
 	
 	fd = open(filename, O_RDONLY);
 	if (fd == -1) {
 		printf("Error opening file %s\n", filename);
-		send404(peerSocket);
-		return;
-	}
-	fp = fopen(filename, "r");
-	if (!fp) {
-		printf("Error opening file %s\n", filename);
-		send404(peerSocket);
+		send404(up);
 		return;
 	}
+	range = getTagValue(buf, "Range:");
 	DEBUG2("File open\n");
 	
 	// Get date and time for our reply
@@ -667,11 +1900,42 @@ void handlePeerDownload(int peerSocket)
 	// And file info
 	if (fstat(fd, &file_stat) < 0) {
 		printf("Error fstat of file %s", filename);
+		free(range);
+		close(fd);
+		send404(up);
 		return;
 	}
 
-	bytesRemaining = file_stat.st_size;
-	sprintf(fileSize, "%d", bytesRemaining);
+	// "Range: <first>-<last>" asks for just those bytes, so a downloader
+	// can fetch slices of one file from several peers at once
+	first = 0;
+	last = (long long)file_stat.st_size - 1;
+	contentRange[0] = '\0';
+	if (range != NULL) {
+		if (sscanf(range, "%lld-%lld", &first, &last) != 2 || first < 0 || first > last
+				|| first >= (long long)file_stat.st_size) {
+			free(range);
+			close(fd);
+			send416(up);
+			return;
+		}
+		if (last >= (long long)file_stat.st_size)
+			last = (long long)file_stat.st_size - 1;
+		snprintf(contentRange, sizeof(contentRange), "Content-Range: %lld-%lld/%lld\r\n", first, last, (long long)file_stat.st_size);
+		free(range);
+	}
+
+	// The checksum of the whole file, if it is one of ours and has not
+	// changed since we worked it out, so the downloader can check what it
+	// gets without reading the file again
+	checksum[0] = '\0';
+	for (i = 0; i < myRfcCount; i++) {
+		if (myRfcs[i].number == rfcNum && myRfcs[i].hasChecksum
+				&& myRfcs[i].mtime == file_stat.st_mtime && myRfcs[i].size == file_stat.st_size) {
+			snprintf(checksum, sizeof(checksum), "Checksum: %s%08x\r\n", CHECKSUM_PREFIX, myRfcs[i].checksum);
+		}
+	}
+
 	modifiedTime = file_stat.st_mtime;
 	tm = *localtime(&modifiedTime);
 	sprintf(str_mdate, "%d-%d-%d %d:%d:%d", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
@@ -679,35 +1943,337 @@ void handlePeerDownload(int peerSocket)
 	//strftime(str_mdate, sizeof(str_mdate), "%d %m %Y", tm);
 	
 	DEBUG2("Time ok\n");
-	strcpy(reply, "P2P-CI/1.0 200 OK\r\nDate: ");
-	strcat(reply, str_date);
-	strcat(reply, "\r\nOS: ");
-	strcat(reply, osbuf.sysname);
-	strcat(reply, " ");
-	strcat(reply, osbuf.release);
-	strcat(reply, "\r\nLast-Modified: ");
-	strcat(reply, str_mdate);
-	strcat(reply, "\r\nContent-Length: ");
-	strcat(reply, fileSize);
-	strcat(reply, "\r\nContent-Type: text/text\r\n\r\n");
-	
-	// Not efficient way to do this, but taking the shortcut.
-	// Should use sendfile() and do more error checking
-	memset(&buf, 0, sizeof(buf));
-	while(fgets(buf, 256, fp) != NULL)
-	{
-		DEBUG2("      read: %s", buf);
-		strcat(reply, buf);
+	up->replyLen = snprintf(up->reply, sizeof(up->reply), "P2P-CI/1.0 %s\r\nDate: %s\r\nOS: %s %s\r\nLast-Modified: %s\r\n"
+		"%sContent-Length: %lld\r\nContent-Type: text/text\r\n%s%s\r\n",
+		(contentRange[0] != '\0') ? "206 Partial Content" : "200 OK",
+		str_date, osbuf.sysname, osbuf.release, str_mdate, contentRange, last - first + 1, checksum,
+		up->keepAlive ? "Connection: keep-alive\r\n" : "");
+	if (up->replyLen < 0 || up->replyLen >= (int)sizeof(up->reply)) {
+		// Sending a header cut short would corrupt the transfer
+		printf("Reply header for %s is too long\n", filename);
+		close(fd);
+		send500(up);
+		return;
 	}
+	DEBUG("Peer Server Sending:\n%s", up->reply);
 	
-	send(peerSocket, reply, strlen(reply), 0);
-	DEBUG("Peer Server Sent:\n%s\n", reply);
+	up->fd = fd;
+	up->offset = first;
+	up->end = last + 1;
+}
+
+void deleteFromWaitList(upload* up);
+
+// Gives an upload a fresh deadline, moving it to the tail if it is already
+// on the list. Every upload waits the same UPLOAD_TIMEOUT, so adding at the
+// tail keeps the list in deadline order.
+void addToWaitList(upload* up)
+{
+	deleteFromWaitList(up);
+	up->deadline = nowMs() + UPLOAD_TIMEOUT * 1000;
+	up->waitNext = NULL;
+	up->waitPrev = waitTail;
+	if (waitTail != NULL)
+		waitTail->waitNext = up;
+	else
+		waitHead = up;
+	waitTail = up;
+}
+
+void deleteFromWaitList(upload* up)
+{
+	if (up->waitPrev != NULL)
+		up->waitPrev->waitNext = up->waitNext;
+	else if (waitHead == up)
+		waitHead = up->waitNext;
+	else
+		return; // not on the list
+	if (up->waitNext != NULL)
+		up->waitNext->waitPrev = up->waitPrev;
+	else
+		waitTail = up->waitPrev;
+	up->waitPrev = up->waitNext = NULL;
+}
+
+void closeUpload(upload* up)
+{
+	DEBUG2("closeUpload()\n");
+	deleteFromWaitList(up);
+	if (up->fd >= 0) {
+		close(up->fd);
+	}
+	close(up->socket); // also removes it from epoll
+	free(up);
+}
+
+// The whole reply has been sent. On a kept-alive connection we go back to
+// waiting for the next request. Otherwise, rather than closing straight
+// away, which can reset the connection before the downloader has read
+// everything, we shut down our side and wait for the downloader to close
+// theirs.
+void finishUpload(upload* up)
+{
+	DEBUG2("finishUpload()\n");
+	if (up->fd >= 0) {
+		close(up->fd);
+		up->fd = -1;
+	}
+	if (up->keepAlive) {
+		up->state = UP_READ_REQUEST;
+	}
+	else {
+		shutdown(up->socket, SHUT_WR);
+		up->state = UP_CLOSING;
+	}
+	addToWaitList(up);
+}
+
+// Sends as much of the reply as the socket will take: first the header,
+// then the file using sendfile() so the body never passes through our
+// buffers. A downloader that stops taking the reply for UPLOAD_TIMEOUT is
+// given up on. Returns 0 if the upload was closed.
+int sendDownloadReply(upload* up)
+{
+	int len;
+	int progress = 0;
+	DEBUG2("sendDownloadReply()\n");
+
+	while (up->replySent < up->replyLen) {
+		// MSG_MORE lets the header share a packet with the start of the file
+		len = send(up->socket, &up->reply[up->replySent], up->replyLen - up->replySent,
+			(up->fd >= 0) ? MSG_MORE : 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break; // wait for EPOLLOUT
+			perror("send");
+			closeUpload(up);
+			return 0;
+		}
+		up->replySent += len;
+		progress = 1;
+	}
+
+	while (up->replySent == up->replyLen && up->fd >= 0 && up->offset < up->end) {
+		len = sendfile(up->socket, up->fd, &up->offset, up->end - up->offset);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break; // wait for EPOLLOUT
+			perror("sendfile");
+			closeUpload(up);
+			return 0;
+		}
+		if (len == 0) {
+			// File got shorter while we were sending it
+			up->end = up->offset;
+			break;
+		}
+		progress = 1;
+	}
+	if (up->replySent < up->replyLen || (up->fd >= 0 && up->offset < up->end)) {
+		if (progress)
+			addToWaitList(up);
+		return 1;
+	}
+	DEBUG("   <sent reply on upload socket %d>\n", up->socket);
 	DEBUG("===============================\n");
-	
-	sleep(1);
-	fclose(fd); // had to close the file AFTER sending for some reason or
-	fclose(fp); //   it seemed to be closing our socket connection :(
-	close(peerSocket);	
+
+	finishUpload(up);
+	return 1;
+}
+
+// Returns the length of the first request in up->request, including the
+// blank line that ends it, or 0 if it has not all arrived yet
+int findDownloadRequestEnd(upload* up)
+{
+	char *crlf = strstr(up->request, "\n\r\n");
+	char *lf = strstr(up->request, "\n\n");
+
+	if (lf != NULL && (crlf == NULL || lf < crlf))
+		return lf + 2 - up->request;
+	if (crlf != NULL)
+		return crlf + 3 - up->request;
+	return 0;
+}
+
+// Reads and answers download requests. A downloader may send several GETs
+// back to back on a kept-alive connection, so after each reply is sent we
+// carry on with whatever has already arrived before reading more.
+void readDownloadRequest(upload* up)
+{
+	int len;
+	int end;
+	int tooLong;
+	char saved;
+	DEBUG2("readDownloadRequest()\n");
+
+	while (up->state == UP_READ_REQUEST) {
+		end = findDownloadRequestEnd(up);
+		tooLong = (end == 0 && up->requestLen == sizeof(up->request) - 1);
+		if (tooLong) {
+			// Not a GET request, so answer what we have
+			end = up->requestLen;
+		}
+		if (end == 0) {
+			len = recv(up->socket, &up->request[up->requestLen], sizeof(up->request) - 1 - up->requestLen, 0);
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return; // wait for the rest
+			}
+			if (len <= 0) {
+				closeUpload(up);
+				return;
+			}
+			up->requestLen += len;
+			up->request[up->requestLen] = '\0';
+			continue;
+		}
+
+		// The downloader now has until the deadline to start taking the reply
+		addToWaitList(up);
+		saved = up->request[end];
+		up->request[end] = '\0';
+		handlePeerDownload(up);
+		up->request[end] = saved;
+		if (tooLong) {
+			up->keepAlive = 0; // we have lost track of where requests start
+		}
+
+		// Keep any requests sent after this one
+		memmove(up->request, &up->request[end], up->requestLen - end + 1);
+		up->requestLen -= end;
+
+		up->state = UP_SEND_REPLY;
+		up->replySent = 0;
+		if (!sendDownloadReply(up)) {
+			return;
+		}
+	}
+}
+
+// A closing upload only has to notice the downloader closing its side
+void drainClosingUpload(upload* up)
+{
+	char buf[256];
+	int len;
+
+	while ((len = recv(up->socket, buf, sizeof(buf), 0)) > 0)
+		;
+	if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		closeUpload(up);
+	}
+}
+
+void acceptDownloads(int listenSocket)
+{
+	int newSocket;
+	struct epoll_event event;
+	upload *up;
+
+	// The listen socket is edge triggered, so accept until none are waiting
+	while ((newSocket = accept(listenSocket, NULL, NULL)) >= 0) {
+		DEBUG("Someone connected for download!\n");
+		up = (upload*)calloc(1, sizeof(upload));
+		if (up == NULL) {
+			printf("ERROR:  No memory for a new download!\n");
+			close(newSocket);
+			continue;
+		}
+		up->socket = newSocket;
+		up->state = UP_READ_REQUEST;
+		up->fd = -1;
+		setSocketBlockingEnabled(newSocket, 0);
+		addToWaitList(up);
+
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = up;
+		if (epoll_ctl(uploadEpollFd, EPOLL_CTL_ADD, newSocket, &event) < 0) {
+			perror("epoll_ctl");
+			closeUpload(up);
+		}
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		// e.g. out of file descriptors. Keep serving the downloads we have
+		perror("accept");
+	}
+}
+
+// The upload server. Every download is served from this one process and
+// epoll loop, so the number of downloads in progress is only limited by
+// the number of sockets we may have open.
+void runUploadServer(int listenSocket)
+{
+	struct epoll_event event;
+	struct epoll_event events[MAX_UPLOAD_EVENTS];
+	struct rlimit limit;
+	upload *up;
+	int i, result, timeout;
+	long long untilDeadline;
+
+	// Allow as many open sockets as the hard limit does
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	// A downloader that goes away mid-transfer only ends its own download
+	signal(SIGPIPE, SIG_IGN);
+
+	uploadEpollFd = epoll_create1(0);
+	if (uploadEpollFd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	setSocketBlockingEnabled(listenSocket, 0);
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (epoll_ctl(uploadEpollFd, EPOLL_CTL_ADD, listenSocket, &event) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	while (1)
+	{
+		// Wake up in time to give up on the oldest download we wait on
+		timeout = -1;
+		if (waitHead != NULL) {
+			untilDeadline = waitHead->deadline - nowMs();
+			timeout = (untilDeadline > 0) ? (int)untilDeadline : 0;
+		}
+
+		result = epoll_wait(uploadEpollFd, events, MAX_UPLOAD_EVENTS, timeout);
+		if (result < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for (i = 0; i < result; i++) {
+			up = (upload*)events[i].data.ptr;
+			if (up == NULL) {
+				acceptDownloads(listenSocket);
+			}
+			else if (up->state == UP_READ_REQUEST) {
+				readDownloadRequest(up);
+			}
+			else if (up->state == UP_SEND_REPLY) {
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+					closeUpload(up);
+				else if (sendDownloadReply(up) && up->state == UP_READ_REQUEST)
+					readDownloadRequest(up); // next pipelined request
+			}
+			else {
+				drainClosingUpload(up);
+			}
+		}
+
+		while (waitHead != NULL && waitHead->deadline <= nowMs()) {
+			closeUpload(waitHead);
+		}
+	}
 }
 
 main (int argc, char *argv[])
@@ -716,7 +2282,6 @@ main (int argc, char *argv[])
     char str[LEN], buf[LEN], hostRight[LEN];
     char potato[BUF_SIZE];
     size_t recv_len = 0;
-    struct hostent *pHostentServer, *pHostentIncoming;
     struct sockaddr_in sinServer, sinIncoming;
     fd_set readset, tempset;
     struct timeval tv;
@@ -750,11 +2315,10 @@ main (int argc, char *argv[])
 			exit (-1);
 		}
     
-    	/* fill in hostent struct for self */
+    	/* look up our own address; downloads we make from ourselves reuse it */
     	gethostname(myHostname, sizeof(myHostname));
-    	pHostentIncoming = gethostbyname(myHostname);
     	DEBUG("Hostname: %s\n", myHostname);
-    	if ( pHostentIncoming == NULL ) {
+    	if ( !resolveHost(myHostname, &sinIncoming.sin_addr, NULL) ) {
         	fprintf(stderr, "%s: host not found (%s)\n", argv[0], myHostname);
         	exit(1);
     	}
@@ -764,7 +2328,6 @@ main (int argc, char *argv[])
     	peerPort = PEER_PORT;
     	sinIncoming.sin_family = AF_INET;
     	sinIncoming.sin_port = htons(peerPort);
-    	memcpy(&sinIncoming.sin_addr, pHostentIncoming->h_addr_list[0], pHostentIncoming->h_length);
     
     	/* bind socket incomingSocket to address sinIncoming */
     	// If port is in use, try the next one
@@ -783,6 +2346,9 @@ main (int argc, char *argv[])
     		exit(rc);
     	}
     
+    	// Both processes use our files' checksums
+    	checksumMyRfcs();
+
     /* 
      *  Fork to create:
      *    Child process - Server socket to accept incoming peer download requests
@@ -791,46 +2357,22 @@ main (int argc, char *argv[])
     
     pid_t child_pid = fork(); 
     if (child_pid == 0) {  // child - create a server socket for peer downloads
-    	int newPeerSocket;   	
-    	
-    	rc = listen(incomingSocket, 5);
+    	rc = listen(incomingSocket, SOMAXCONN);
     	if ( rc < 0 ) {
         	perror("listen:");
         	exit(rc);
     	}
         
-		while (1)
-		{
-			newPeerSocket = accept(incomingSocket, NULL, NULL);
-			if (newPeerSocket < 0) {
-				perror("accept");
-				exit(1);
-			}
-			
-			pid_t pid = fork();
-			if (pid == 0) { // child - do the peer download processing
-				DEBUG("Someone connected for download!\n");
-				close(incomingSocket);
-				handlePeerDownload(newPeerSocket);
-				exit(0);
-			}
-			else if (pid > 0) { // parent - go back to handling incoming peer connections
-				close(newPeerSocket);
-			}
-			else { // error forking
-        		printf("ERROR:  Could not fork a new process!\n");
-    		}
-    	}
+    	runUploadServer(incomingSocket);
 
     	DEBUG2("Child should not be exiting!\n");
     }
     else if (child_pid > 0) { // parent - connecting to server socket
-    	/* fill in hostent struct */
+    	/* look up the server's address */
     	close(incomingSocket);
     	strcpy(serverHostname, argv[1]);
     	printf("Server Hostname: %s", serverHostname);
-    	pHostentServer = gethostbyname(argv[1]); 
-    	if ( pHostentServer == NULL ) {
+    	if ( !resolveHost(argv[1], &sinServer.sin_addr, NULL) ) {
         	fprintf(stderr, "%s: host not found (%s)\n", argv[0], argv[1]);
         	exit(1);
     	}
@@ -858,7 +2400,6 @@ main (int argc, char *argv[])
     	serverPort = SERVER_PORT;
     	sinServer.sin_family = AF_INET;
     	sinServer.sin_port = htons(serverPort);
-    	memcpy(&sinServer.sin_addr, pHostentServer->h_addr_list[0], pHostentServer->h_length);
     
     	// connect to socket at above addr and port
     	rc = connect(serverSocket, (struct sockaddr *)&sinServer, sizeof(sinServer));
@@ -867,10 +2408,11 @@ main (int argc, char *argv[])
         	exit(rc);
     	}
     
-    	// Send the server our hostname and listening port so it can let
-    	// other peers know how to connect to us
-    	len = send(serverSocket, myHostname, strlen(myHostname), 0);
-    	if (len != strlen(myHostname)) {
+    	// Send the server our hostname, NUL included so it knows where it
+    	// ends, and listening port so it can let other peers know how to
+    	// connect to us
+    	len = send(serverSocket, myHostname, strlen(myHostname) + 1, 0);
+    	if (len != strlen(myHostname) + 1) {
     		perror("send");
     		exit(1);
     	}
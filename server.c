@@ -30,67 +30,552 @@ Each item of the linked list representing the index of RFCs contains these eleme
  *  and index, and it also returns any information requested by the peer. When the peer closes the connection, this process removes all records associated with
  *  the peer and then terminates.
  *
+ *  Implementation note: the index of RFCs is kept as a hash table keyed by RFC number. Each bucket holds the records for
+ *  that RFC (one per peer holding it) in arrays, one per field, so LOOKUP only touches the peers that have the RFC.
+ *  The server can run several worker threads (-t), each with its own event loop and share of the connections. The index
+ *  is split into shards by RFC number. Writers take a shard's lock; LOOKUP and LIST take no lock at all but read the
+ *  buckets the writers publish, which are only freed once every worker has finished its event loop turn.
+ *
  *****************************************************************************/
 
 /*........................ Include Files ....................................*/
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
 
 //#define DEBUG printf
 #define DEBUG //
 
 #define LEN 200
-#define MAX_MSG_SIZE 2000
 #define WELL_KNOWN_PORT 7734
-#define MAX_CLIENTS 100
+#define MAX_EVENTS 64        // events handled per epoll_wait() call
+#define HANDSHAKE_TIMEOUT 10 // seconds a new peer has to register
+#define READ_BUF_INITIAL 1024      // first size of a connection's read buffer
+#define MAX_REQUEST_SIZE (1 << 20) // largest request we will buffer
+#define MAX_REQUESTS_PER_TURN 64   // pipelined requests run before other peers get a turn
+#define OUT_CHUNK_SIZE 8192        // usual size of a block of queued output
+#define OUT_HIGH_WATER (1 << 20)   // default for outHighWater, see -w
+#define MAX_ROW_SIZE (2 * LEN + 80) // longest "RFC n title host port checksum address" row
+#define CHECKSUM_PREFIX "crc32:"    // a checksum is this and 8 hex digits
+#define ADDRESS_PREFIX "addr:"      // an address is this and a dotted quad
+
+// Registration states a connection moves through before it may send requests
+#define CONN_WAIT_HOSTNAME 0 // waiting for the peer's hostname
+#define CONN_WAIT_PORT     1 // waiting for the peer's 4 byte upload port
+#define CONN_READY         2 // registered, handling P2S requests
 
 typedef struct peer {
 	char hostname[LEN];
 	int port;
 	int socket;
+	struct in_addr address; // where the peer connected to us from
+	struct rfcList* rfcs; // index records this peer added, linked by ownerNext
 } peer;
 
+// One record, as it is added and formatted. In the index its fields are
+// kept in the columns of its RFC's bucket.
 typedef struct rfc {
 	int number;
 	int port;
-	char title[LEN];
-	char peerHostname[LEN];
+	const char* title;        // interned, see internText()
+	const char* peerHostname; // interned
+	bool hasChecksum;     // the peer registered the file's CRC-32
+	uint32_t checksum;
+	struct in_addr address; // numeric address of the peer that has it
 } rfc;
 
 typedef struct peerList {
 	peer* item;
 	struct peerList* next;
+	struct peerList* prev;
 } peerList;
 
+// A record's entry in the list of records its peer added, so they can all
+// be found again when the peer leaves. The record itself is the one in
+// 'bucket' at 'slot'.
 typedef struct rfcList {
-	rfc* item;
-	struct rfcList* next;
+	struct rfcBucket* bucket;   // bucket this record lives in
+	int slot;                   // the record's position in the bucket's columns
+	struct rfcList* ownerNext;  // next record added by the same peer
 } rfcList;
 
+// Anything a reader might still be looking at when a writer replaces it
+// starts with one of these, so it can wait on the retired list until every
+// worker has passed a quiescent point. See retire().
+typedef struct rcuHead {
+	struct rcuHead* next;
+	unsigned long epoch;  // rcuEpoch when it was retired
+} rcuHead;
+
+// The RFC index is a hash table keyed by RFC number, split into shards. Each
+// bucket holds every record (one per peer) for a single RFC number, so a
+// LOOKUP only has to walk the peers that actually have the RFC. Buckets are
+// also chained together in the order they were created so LIST can walk the
+// whole index.
+//
+// The records are stored a column per field, so formatting a bucket's rows
+// sweeps through memory in order instead of visiting a heap node per
+// record, and a row's title and hostname are read from the one interned
+// copy when it is sent. Each record's entry in its peer's list knows its
+// slot, and a removed record's slot is filled by the last record, so
+// records move around but removal is O(1).
+//
+// Readers only follow hashNext, orderNext and columns, which writers change
+// with atomic stores once the new target is complete, and read the records
+// in the columns. Writers store each field of a record atomically and make
+// 'changes' odd while they do, so a reader that overlapped a change knows
+// to read the bucket again.
+//
+// A LOOKUP keeps the rows it formatted in 'rows', so repeated queries for a
+// popular RFC just copy the same bytes until the bucket changes. Writers
+// only drop that copy; the next LOOKUP formats a new one.
+typedef struct rfcBucket {
+	rcuHead rcu;
+	int number;
+	unsigned long serial;        // when it was created, see indexShard
+	int count;                   // records for this RFC
+	unsigned int changes;        // odd while a writer is changing the records
+	struct recordColumns* columns; // NULL until the first record is added
+	struct rowCache* rows;       // formatted rows as of 'changes', or NULL
+	struct rfcBucket* hashNext;  // next bucket in the same hash slot
+	struct rfcBucket* orderPrev; // buckets in creation order, for LIST
+	struct rfcBucket* orderNext;
+} rfcBucket;
+
+// A bucket's reply rows, each ending in \r\n, as they were when the
+// bucket's 'changes' was 'changes'. Never changed once published.
+typedef struct rowCache {
+	rcuHead rcu;
+	unsigned int changes;
+	int len;
+	char data[];
+} rowCache;
+
+// A bucket's records, a column per field. The columns follow this header in
+// the same block. Growing a bucket publishes a new block, so a reader can
+// carry on with the old one.
+typedef struct recordColumns {
+	rcuHead rcu;
+	int capacity;                // records there is room for
+	struct rfcList** owners;     // each record's entry in its peer's list, writers only
+	const char** titles;         // interned
+	const char** hosts;          // interned
+	int* ports;
+	struct in_addr* addresses;
+	uint32_t* checksums;
+	bool* hasChecksums;
+} recordColumns;
+
+// A shard's hash slots. Growing the shard publishes a new table.
+#define BUCKET_INITIAL_CAPACITY 2 // records, most RFCs are held by a few peers
+#define BUCKET_RECORD_SIZE (3 * sizeof(void*) + sizeof(int) + sizeof(struct in_addr) \
+                            + sizeof(uint32_t) + sizeof(bool)) // bytes per record in the columns
+
+typedef struct slotTable {
+	rcuHead rcu;
+	int size;               // number of hash slots
+	rfcBucket* slots[];
+} slotTable;
+
+#define RFC_INDEX_INITIAL_SIZE 1024 // slots per shard, must be a power of two
+#define INDEX_SHARD_BITS 4
+#define INDEX_SHARDS (1 << INDEX_SHARD_BITS)
+
+// One share of the RFC index. RFC numbers are spread over the shards by
+// hash and each shard has its own lock, so ADDs and disconnects on
+// different threads mostly do not wait for each other. Queries never take
+// the lock.
+typedef struct indexShard {
+	pthread_mutex_t lock;   // held by writers only
+	slotTable *table;
+	unsigned int resizes;   // odd while the table is being grown
+	int buckets;            // number of distinct RFC numbers in the shard
+	unsigned long serials;  // buckets ever created here, numbering them in order
+	rfcBucket *bucketHead;  // first bucket created, start of LIST
+	rfcBucket *bucketTail;
+} indexShard;
+
+indexShard shards[INDEX_SHARDS];
+
+// Each worker's place in the grace period. A worker stores the current
+// rcuEpoch when it wakes up from epoll_wait() and 0 while it sleeps, so
+// anything retired at an earlier epoch than every awake worker's can no
+// longer be in use. Padded so workers do not share a cache line.
+typedef struct rcuReader {
+	unsigned long epoch;
+	char pad[64 - sizeof(unsigned long)];
+} rcuReader;
+
+#define RECLAIM_INTERVAL 100 // ms a worker with retired memory may sleep
+
+unsigned long rcuEpoch = 1;
+rcuReader *rcuReaders;
+__thread rcuReader *myReader;
+__thread rcuHead *retiredHead = NULL; // this worker's retired memory, oldest first
+__thread rcuHead *retiredTail = NULL;
+
+// Peers registered with any worker. Only changed when a peer registers or
+// leaves, so a plain mutex is enough.
 struct peerList *peerHead = NULL;
 struct peerList *peerTail = NULL;
-struct rfcList *rfcHead = NULL;
-struct rfcList *rfcTail = NULL;
+pthread_mutex_t peerListLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SLAB_SIZE (64 * 1024) // bytes a pool takes from malloc() at a time
+
+// Hands out objects of one size, carved from SLAB_SIZE blocks. Freed
+// objects go on a free list, holding the link in their first bytes, and are
+// handed out again before any new block is taken, so peers coming and going
+// reuse the same memory instead of fragmenting the heap. Blocks are never
+// given back.
+typedef struct slabPool {
+	size_t size;     // object size
+	void* freeList;
+	char* next;      // unused part of the newest block
+	char* end;
+} slabPool;
+
+#define SLAB_POOL(type) { sizeof(type), NULL, NULL, NULL }
+
+// Pools for peers and their list entries. An entry is made and freed by the
+// worker serving its peer's connection, and connections never move between
+// workers, so each worker has its own pools and needs no lock.
+__thread slabPool peerPool = SLAB_POOL(struct peer);
+__thread slabPool peerNodePool = SLAB_POOL(struct peerList);
+__thread slabPool rfcNodePool = SLAB_POOL(struct rfcList);
+
+#define INTERN_INITIAL_SIZE 256 // slots per shard, must be a power of two
+#define INTERN_SHARD_BITS 4
+#define INTERN_SHARDS (1 << INTERN_SHARD_BITS)
+
+// The one shared copy of a hostname or title. Records point at the text,
+// so a peer's hostname is kept once however many RFCs it has, and a title
+// once however many peers have the RFC. Retired with the last record using
+// it, as queries read the text without a lock.
+typedef struct internedString {
+	rcuHead rcu;
+	struct internedString* next; // next in the same hash slot
+	unsigned int hash;
+	int refs;                    // records using it
+	int len;
+	char text[];
+} internedString;
+
+// Titles come from every worker, so the strings are split into shards by
+// hash, each with its own lock, like the RFC index.
+typedef struct internShard {
+	pthread_mutex_t lock;
+	internedString **slots;
+	int size;               // number of hash slots
+	int count;              // number of strings in the shard
+} internShard;
+
+internShard internShards[INTERN_SHARDS];
+
+// A block of output waiting to be sent. A connection's replies are appended
+// to a chain of these and sent as the socket will take them.
+typedef struct outChunk {
+	struct outChunk* next;
+	int cap;    // size of data
+	int len;    // bytes written into data
+	int sent;   // bytes of data already sent
+	char data[];
+} outChunk;
+
+// State kept for each connected peer. A pointer to it is stored with the
+// socket in epoll, so an event leads straight to its connection.
+typedef struct connection {
+	int socket;
+	int state;             // one of the CONN_ states
+	struct peerList* peer; // this connection's entry in the peer list, once registered
+
+	// Bytes received that do not yet make up a complete request. The buffer
+	// is only allocated while there is something in it.
+	char* readBuf;
+	int readLen;
+	int readCap;
+	int scanned;           // how far the first request has been searched for its end
+
+	// Replies not yet sent, oldest first
+	outChunk* outHead;
+	outChunk* outTail;
+	int outQueued;         // bytes waiting in the chain
+	bool readPaused;       // stopped reading until the peer takes its replies
+	bool readClosed;       // the peer has shut down its side, drop it once its replies are sent
+
+	// Where a LIST too long to queue at once carries on from. Only numbers
+	// are kept, since the buckets may be freed between turns.
+	bool listing;
+	int listShard;             // shard being listed
+	int listNumber;            // RFC number of the last bucket listed from it
+	unsigned long listSerial;  // and its serial, 0 if none yet
+
+	// Set while the connection used up its turn with input still waiting
+	bool onReadyList;
+	struct connection* readyPrev;
+	struct connection* readyNext;
+
+	// Registration progress, only used until the state is CONN_READY
+	peer* pending;         // peer being filled in from the handshake
+	int received;          // bytes received so far for the current step
+	int32_t portBuf;       // port in network byte order
+	long long deadline;    // time (ms) by which registration must finish
+	struct connection* handshakePrev;
+	struct connection* handshakeNext;
+} connection;
+
+// A piece of a receive buffer. Not NUL terminated.
+typedef struct strView {
+	char* ptr;
+	int len;
+} strView;
+
+// A parsed request. Every field points into the connection's receive buffer,
+// so parsing needs no allocation or copying. Fields that were not sent have
+// a length of 0.
+typedef struct request {
+	strView method;
+	strView rfcNumber;  // RFC number, or the word after the method (e.g. LIST ALL)
+	strView version;
+	strView host;
+	strView port;
+	strView title;
+	strView checksum;
+	strView headers;    // everything after the request line, for BULKADD rows
+} request;
+
+// Each worker thread has its own epoll instance, listen socket and lists of
+// connections, so these are all thread local.
+__thread int epollFd;         // epoll instance watching the worker's sockets
+__thread int listenSocket;    // Socket to listen for incoming connections
+int workerCount = 1;          // worker threads to run, set with -t
+struct sockaddr_in listenAddress; // where every worker listens
+// Once this many reply bytes are waiting for a peer, we stop reading its
+// requests until it has taken half of them. Set with -w.
+int outHighWater = OUT_HIGH_WATER;
+// Send each peer's numeric address in LOOKUP and LIST rows, so downloaders
+// need not look up its hostname. Turned off with -a.
+bool sendAddresses = true;
+
+// Connections that have not finished registering, oldest first. They all
+// get the same timeout, so this is also the order their deadlines expire in.
+__thread connection *handshakeHead = NULL;
+__thread connection *handshakeTail = NULL;
+
+// Connections that stopped reading to give other peers a turn. The socket
+// is edge triggered, so epoll will not report them again until they have
+// drained everything; the main loop comes back to them instead.
+__thread connection *readyHead = NULL;
+__thread connection *readyTail = NULL;
+
+// Where a worker formats a bucket's rows, grown to fit the biggest bucket
+// it has sent
+__thread char *rowBuf = NULL;
+__thread int rowBufCap = 0;
+
+void* slabAlloc(slabPool* pool)
+{
+	void *obj = pool->freeList;
+
+	if (obj != NULL) {
+		pool->freeList = *(void**)obj;
+		return obj;
+	}
+	if (pool->next == NULL || (size_t)(pool->end - pool->next) < pool->size) {
+		pool->next = (char*)malloc(SLAB_SIZE);
+		if (pool->next == NULL) {
+			pool->end = NULL;
+			return NULL;
+		}
+		pool->end = pool->next + SLAB_SIZE;
+	}
+	obj = pool->next;
+	pool->next += pool->size;
+	return obj;
+}
+
+void slabFree(slabPool* pool, void* obj)
+{
+	if (obj == NULL)
+		return;
+	*(void**)obj = pool->freeList;
+	pool->freeList = obj;
+}
+
+void initInternTable()
+{
+	int i;
+	for (i = 0; i < INTERN_SHARDS; i++) {
+		internShards[i].size = INTERN_INITIAL_SIZE;
+		internShards[i].slots = (internedString**)calloc(INTERN_INITIAL_SIZE, sizeof(internedString*));
+		if (internShards[i].slots == NULL || pthread_mutex_init(&internShards[i].lock, NULL) != 0) {
+			printf("String table creation failed \n");
+			exit(1);
+		}
+	}
+}
+
+unsigned int hashText(const char* text, int len)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+	}
+	return hash;
+}
+
+internShard* internShardFor(unsigned int hash)
+{
+	return &internShards[hash >> (32 - INTERN_SHARD_BITS)];
+}
+
+internedString* stringHeader(const char* text)
+{
+	return (internedString*)(text - offsetof(internedString, text));
+}
+
+// Doubles a shard's hash slots. The caller holds the shard's lock.
+void growInternShard(internShard* shard)
+{
+	int newSize = shard->size * 2;
+	internedString **newSlots;
+	internedString *str, *next;
+	int i;
+
+	newSlots = (internedString**)calloc(newSize, sizeof(internedString*));
+	if (newSlots == NULL) {
+		return; // longer chains, but still correct
+	}
+	for (i = 0; i < shard->size; i++) {
+		for (str = shard->slots[i]; str != NULL; str = next) {
+			next = str->next;
+			str->next = newSlots[str->hash & (newSize - 1)];
+			newSlots[str->hash & (newSize - 1)] = str;
+		}
+	}
+	free(shard->slots);
+	shard->slots = newSlots;
+	shard->size = newSize;
+}
+
+// Returns the shared copy of the first 'len' bytes of 'text', cut to fit
+// in LEN like the rest of a row, and adds a reference to it. Returns NULL
+// if there is no memory for a new string.
+const char* internText(const char* text, int len)
+{
+	internShard *shard;
+	internedString *str;
+	unsigned int hash, slot;
+
+	if (len > LEN - 1)
+		len = LEN - 1;
+	hash = hashText(text, len);
+	shard = internShardFor(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	for (str = shard->slots[hash & (shard->size - 1)]; str != NULL; str = str->next) {
+		if (str->hash == hash && str->len == len && memcmp(str->text, text, len) == 0) {
+			str->refs++;
+			pthread_mutex_unlock(&shard->lock);
+			return str->text;
+		}
+	}
+	if (shard->count >= shard->size) {
+		growInternShard(shard);
+	}
+	str = (internedString*)malloc(sizeof(internedString) + len + 1);
+	if (str == NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		printf("String creation failed \n");
+		return NULL;
+	}
+	str->hash = hash;
+	str->refs = 1;
+	str->len = len;
+	memcpy(str->text, text, len);
+	str->text[len] = '\0';
+	slot = hash & (shard->size - 1);
+	str->next = shard->slots[slot];
+	shard->slots[slot] = str;
+	shard->count++;
+	pthread_mutex_unlock(&shard->lock);
+	return str->text;
+}
+
+// Adds a reference to a string internText() returned
+void retainText(const char* text)
+{
+	internedString *str = stringHeader(text);
+	internShard *shard = internShardFor(str->hash);
+
+	pthread_mutex_lock(&shard->lock);
+	str->refs++;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void retire(rcuHead* head);
+
+// Drops a reference to a string internText() returned, retiring it once no
+// record uses it
+void releaseText(const char* text)
+{
+	internedString *str, **link;
+	internShard *shard;
+
+	if (text == NULL)
+		return;
+	str = stringHeader(text);
+	shard = internShardFor(str->hash);
+
+	pthread_mutex_lock(&shard->lock);
+	if (--str->refs > 0) {
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+	link = &shard->slots[str->hash & (shard->size - 1)];
+	while (*link != str) {
+		link = &(*link)->next;
+	}
+	*link = str->next;
+	shard->count--;
+	pthread_mutex_unlock(&shard->lock);
+	retire(&str->rcu);
+}
 
-int clientList[MAX_CLIENTS];  // Array of connected client sockets
-fd_set readset;               // Set of sockets to 'select' on
-int listenSocket;             // Socket to listen for incoming connections
-int maxfd;                    // highest number socket for 'select'
+// Drops a record's strings. Either may be NULL if the record was never
+// finished.
+void releaseRfcText(rfc* item)
+{
+	releaseText(item->title);
+	releaseText(item->peerHostname);
+}
 
 struct peerList* createPeerList(peer* item)
 {
 	DEBUG("createPeerList()\n");
     DEBUG("   creating list with headnode [%s]\n",item->hostname);
-    struct peerList *ptr = (struct peerList*)malloc(sizeof(struct peerList));
+    struct peerList *ptr = (struct peerList*)slabAlloc(&peerNodePool);
     if(ptr == NULL)
     {
         printf("Node creation failed \n");
@@ -98,26 +583,11 @@ struct peerList* createPeerList(peer* item)
     }
     ptr->item = item;
     ptr->next = NULL;
+    ptr->prev = NULL;
 
     peerHead = peerTail = ptr;
     return ptr;
 }
-struct rfcList* createRfcList(rfc* item)
-{
-	DEBUG("createRfcList()\n");
-    DEBUG("   creating list with headnode as [%d]\n",item->number);
-    struct rfcList *ptr = (struct rfcList*)malloc(sizeof(struct rfcList));
-    if(ptr == NULL)
-    {
-        printf("Node creation failed \n");
-        return NULL;
-    }
-    ptr->item = item;
-    ptr->next = NULL;
-
-    rfcHead = rfcTail = ptr;
-    return ptr;
-}
 
 struct peerList* addToPeerList(peer* item)
 {
@@ -131,7 +601,7 @@ struct peerList* addToPeerList(peer* item)
         return (createPeerList(item));
     }
 
-    struct peerList *ptr = (struct peerList*)malloc(sizeof(struct peerList));
+    struct peerList *ptr = (struct peerList*)slabAlloc(&peerNodePool);
     if(ptr == NULL)
     {
         printf("Node creation failed \n");
@@ -139,6 +609,7 @@ struct peerList* addToPeerList(peer* item)
     }
     ptr->item = item;
     ptr->next = NULL;
+    ptr->prev = peerTail;
 
 	// Put it at the end of the linked list
     peerTail->next = ptr;
@@ -146,28 +617,383 @@ struct peerList* addToPeerList(peer* item)
 
     return ptr;
 }
-struct rfcList* addToRfcList(rfc* item)
+unsigned int hashRfcNumber(int rfcNum)
 {
-	DEBUG("addToRfcList()\n");
-    if(rfcHead == NULL)
-    {
-        return (createRfcList(item));
-    }
+	// Multiplicative hash so sequential RFC numbers spread across the table
+	return ((unsigned int)rfcNum * 2654435761u);
+}
 
-    struct rfcList *ptr = (struct rfcList*)malloc(sizeof(struct rfcList));
-    if(ptr == NULL)
-    {
-        printf("Node creation failed \n");
-        return NULL;
-    }
-    ptr->item = item;
-    ptr->next = NULL;
+// The shard an RFC number lives in. Hash slots within a shard use the low
+// bits of the hash, so the shard is picked by the high bits.
+indexShard* shardFor(int rfcNum)
+{
+	return &shards[hashRfcNumber(rfcNum) >> (32 - INDEX_SHARD_BITS)];
+}
 
-	// Put it at the end of the linked list
-    rfcTail->next = ptr;
-    rfcTail = ptr;
+// Hands memory that readers may still be using to the grace period. It is
+// freed by reclaimRetired() once every worker has been back to sleep or
+// woken up again since, so no query can still hold a pointer to it.
+void retire(rcuHead* head)
+{
+	head->next = NULL;
+	head->epoch = __atomic_fetch_add(&rcuEpoch, 1, __ATOMIC_SEQ_CST);
+	if (retiredTail != NULL)
+		retiredTail->next = head;
+	else
+		retiredHead = head;
+	retiredTail = head;
+}
 
-    return ptr;
+// Frees this worker's retired memory that no worker can still see
+void reclaimRetired()
+{
+	unsigned long oldest = ULONG_MAX;
+	unsigned long epoch;
+	rcuHead *head;
+	int i;
+
+	if (retiredHead == NULL)
+		return;
+	for (i = 0; i < workerCount; i++) {
+		epoch = __atomic_load_n(&rcuReaders[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+	while (retiredHead != NULL && retiredHead->epoch < oldest) {
+		head = retiredHead;
+		retiredHead = head->next;
+		free(head);
+	}
+	if (retiredHead == NULL)
+		retiredTail = NULL;
+}
+
+// Called as the worker wakes up, before it looks at the index
+void rcuOnline()
+{
+	__atomic_store_n(&myReader->epoch, __atomic_load_n(&rcuEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Called before the worker sleeps, once it holds no pointers into the index
+void rcuOffline()
+{
+	__atomic_store_n(&myReader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+int formatRow(char* row, rfc* item);
+
+slotTable* createSlotTable(int size)
+{
+	slotTable *table = (slotTable*)calloc(1, sizeof(slotTable) + size * sizeof(rfcBucket*));
+	if (table != NULL)
+		table->size = size;
+	return table;
+}
+
+void initRfcIndex()
+{
+	int i;
+	DEBUG("initRfcIndex()\n");
+	for (i = 0; i < INDEX_SHARDS; i++) {
+		shards[i].table = createSlotTable(RFC_INDEX_INITIAL_SIZE);
+		if (shards[i].table == NULL || pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+			printf("RFC index creation failed \n");
+			exit(1);
+		}
+	}
+}
+
+// Double the number of hash slots in a shard and rehash every bucket into
+// them. Called once the shard is as full as it has slots so chains stay
+// short. The caller holds the shard's lock. Rehashing changes the buckets'
+// hashNext links under any reader walking the old table, so 'resizes' is
+// odd meanwhile to tell findRfcBucket() to look again if it misses.
+void growRfcIndex(indexShard* shard)
+{
+	slotTable *oldTable = shard->table;
+	slotTable *newTable;
+	rfcBucket *bucket;
+	unsigned int slot;
+	DEBUG("growRfcIndex() - %d slots\n", oldTable->size * 2);
+
+	newTable = createSlotTable(oldTable->size * 2);
+	if (newTable == NULL) {
+		// Keep running with longer chains rather than lose the index
+		printf("RFC index resize failed \n");
+		return;
+	}
+	__atomic_store_n(&shard->resizes, shard->resizes + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (bucket = shard->bucketHead; bucket != NULL; bucket = bucket->orderNext) {
+		slot = hashRfcNumber(bucket->number) & (newTable->size - 1);
+		__atomic_store_n(&bucket->hashNext, newTable->slots[slot], __ATOMIC_RELEASE);
+		newTable->slots[slot] = bucket;
+	}
+	__atomic_store_n(&shard->table, newTable, __ATOMIC_RELEASE);
+	__atomic_store_n(&shard->resizes, shard->resizes + 1, __ATOMIC_RELEASE);
+	retire(&oldTable->rcu);
+}
+
+// Safe without the shard's lock. A bucket being added or removed meanwhile
+// may or may not be found, either is right, but one that has been there all
+// along can only be missed while the shard grows, so then look again.
+rfcBucket* findRfcBucket(indexShard* shard, int rfcNum)
+{
+	slotTable *table;
+	rfcBucket *bucket;
+	unsigned int resizes;
+	DEBUG("findRfcBucket() - [%d]\n", rfcNum);
+
+	do {
+		resizes = __atomic_load_n(&shard->resizes, __ATOMIC_ACQUIRE);
+		table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+		bucket = __atomic_load_n(&table->slots[hashRfcNumber(rfcNum) & (table->size - 1)], __ATOMIC_ACQUIRE);
+		while (bucket != NULL && bucket->number != rfcNum) {
+			bucket = __atomic_load_n(&bucket->hashNext, __ATOMIC_ACQUIRE);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (bucket == NULL && ((resizes & 1) || __atomic_load_n(&shard->resizes, __ATOMIC_RELAXED) != resizes));
+	return bucket;
+}
+
+rfcBucket* createRfcBucket(int rfcNum)
+{
+	DEBUG("createRfcBucket() - [%d]\n", rfcNum);
+	rfcBucket *bucket = (rfcBucket*)calloc(1, sizeof(rfcBucket));
+	if (bucket == NULL)
+	{
+		printf("Bucket creation failed \n");
+		return NULL;
+	}
+	bucket->number = rfcNum;
+	return bucket;
+}
+
+// Allocates columns with room for 'capacity' records. Columns go in order
+// of alignment.
+recordColumns* createColumns(int capacity)
+{
+	recordColumns *cols = (recordColumns*)malloc(sizeof(recordColumns) + capacity * BUCKET_RECORD_SIZE);
+
+	if (cols == NULL)
+		return NULL;
+	cols->capacity = capacity;
+	cols->owners = (struct rfcList**)(cols + 1);
+	cols->titles = (const char**)(cols->owners + capacity);
+	cols->hosts = cols->titles + capacity;
+	cols->ports = (int*)(cols->hosts + capacity);
+	cols->addresses = (struct in_addr*)(cols->ports + capacity);
+	cols->checksums = (uint32_t*)(cols->addresses + capacity);
+	cols->hasChecksums = (bool*)(cols->checksums + capacity);
+	return cols;
+}
+
+// Doubles the room in a bucket's columns and publishes the new ones. The
+// caller holds the shard's lock.
+bool growBucket(rfcBucket* bucket)
+{
+	recordColumns *old = bucket->columns;
+	recordColumns *cols = createColumns((old != NULL) ? old->capacity * 2 : BUCKET_INITIAL_CAPACITY);
+	int n = bucket->count;
+
+	if (cols == NULL) {
+		printf("Bucket resize failed \n");
+		return false;
+	}
+	if (old != NULL) {
+		memcpy(cols->owners, old->owners, n * sizeof(*old->owners));
+		memcpy(cols->titles, old->titles, n * sizeof(*old->titles));
+		memcpy(cols->hosts, old->hosts, n * sizeof(*old->hosts));
+		memcpy(cols->ports, old->ports, n * sizeof(*old->ports));
+		memcpy(cols->addresses, old->addresses, n * sizeof(*old->addresses));
+		memcpy(cols->checksums, old->checksums, n * sizeof(*old->checksums));
+		memcpy(cols->hasChecksums, old->hasChecksums, n * sizeof(*old->hasChecksums));
+	}
+	__atomic_store_n(&bucket->columns, cols, __ATOMIC_RELEASE);
+	if (old != NULL)
+		retire(&old->rcu);
+	return true;
+}
+
+// Reads record 'i' back out of the columns. Safe without the shard's lock,
+// but a reader must check the bucket's 'changes' afterwards.
+void loadRecord(rfcBucket* bucket, recordColumns* cols, int i, rfc* item)
+{
+	item->number = bucket->number;
+	item->port = __atomic_load_n(&cols->ports[i], __ATOMIC_RELAXED);
+	item->title = __atomic_load_n(&cols->titles[i], __ATOMIC_ACQUIRE);
+	item->peerHostname = __atomic_load_n(&cols->hosts[i], __ATOMIC_ACQUIRE);
+	item->hasChecksum = __atomic_load_n(&cols->hasChecksums[i], __ATOMIC_RELAXED);
+	item->checksum = __atomic_load_n(&cols->checksums[i], __ATOMIC_RELAXED);
+	item->address.s_addr = __atomic_load_n(&cols->addresses[i].s_addr, __ATOMIC_RELAXED);
+}
+
+// Writes record 'i' into the columns. The caller holds the shard's lock
+// and has called beginChange(). The strings are published with release
+// stores, so a reader that sees a pointer sees the text too.
+void storeRecord(recordColumns* cols, int i, rfc* item)
+{
+	__atomic_store_n(&cols->ports[i], item->port, __ATOMIC_RELAXED);
+	__atomic_store_n(&cols->titles[i], item->title, __ATOMIC_RELEASE);
+	__atomic_store_n(&cols->hosts[i], item->peerHostname, __ATOMIC_RELEASE);
+	__atomic_store_n(&cols->hasChecksums[i], item->hasChecksum, __ATOMIC_RELAXED);
+	__atomic_store_n(&cols->checksums[i], item->checksum, __ATOMIC_RELAXED);
+	__atomic_store_n(&cols->addresses[i].s_addr, item->address.s_addr, __ATOMIC_RELAXED);
+}
+
+// Called by a writer, holding the shard's lock, around any change to a
+// bucket's records
+void beginChange(rfcBucket* bucket)
+{
+	__atomic_store_n(&bucket->changes, bucket->changes + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Ends a change, dropping the bucket's formatted rows, which are now out
+// of date
+void endChange(rfcBucket* bucket)
+{
+	rowCache *rows;
+
+	__atomic_store_n(&bucket->changes, bucket->changes + 1, __ATOMIC_RELEASE);
+	rows = __atomic_exchange_n(&bucket->rows, NULL, __ATOMIC_ACQ_REL);
+	if (rows != NULL)
+		retire(&rows->rcu);
+}
+
+// Takes record 'i' out of a bucket, moving the last record into its slot,
+// and drops its strings. The caller holds the shard's lock.
+void removeRecord(rfcBucket* bucket, int i)
+{
+	recordColumns *cols = bucket->columns;
+	int last = bucket->count - 1;
+	rfc item;
+
+	releaseText(cols->titles[i]);
+	releaseText(cols->hosts[i]);
+	beginChange(bucket);
+	if (i != last) {
+		loadRecord(bucket, cols, last, &item);
+		storeRecord(cols, i, &item);
+		cols->owners[i] = cols->owners[last];
+		cols->owners[i]->slot = i;
+	}
+	__atomic_store_n(&bucket->count, last, __ATOMIC_RELEASE);
+	endChange(bucket);
+}
+
+// Links a new bucket, with its first record already in place, into
+// its hash slot and the creation order list, where readers will see it. The
+// caller holds the shard's lock.
+void publishRfcBucket(indexShard* shard, rfcBucket* bucket)
+{
+	slotTable *table;
+	unsigned int slot;
+
+	if (shard->buckets >= shard->table->size) {
+		growRfcIndex(shard);
+	}
+	table = shard->table;
+
+	slot = hashRfcNumber(bucket->number) & (table->size - 1);
+	bucket->serial = ++shard->serials;
+	bucket->hashNext = table->slots[slot];
+	bucket->orderNext = NULL;
+	bucket->orderPrev = shard->bucketTail;
+	__atomic_store_n(&table->slots[slot], bucket, __ATOMIC_RELEASE);
+
+	// Put it at the end of the creation order list
+	if (shard->bucketTail != NULL)
+		__atomic_store_n(&shard->bucketTail->orderNext, bucket, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&shard->bucketHead, bucket, __ATOMIC_RELEASE);
+	shard->bucketTail = bucket;
+
+	shard->buckets++;
+}
+
+// Unlinks an empty bucket from its hash slot and the creation order list
+// and retires it. Its own links are left alone for any reader still on it.
+// The caller holds the shard's lock.
+void deleteRfcBucket(indexShard* shard, rfcBucket* bucket)
+{
+	rfcBucket **link;
+	DEBUG("deleteRfcBucket() - [%d]\n", bucket->number);
+
+	link = &shard->table->slots[hashRfcNumber(bucket->number) & (shard->table->size - 1)];
+	while (*link != bucket) {
+		link = &(*link)->hashNext;
+	}
+	__atomic_store_n(link, bucket->hashNext, __ATOMIC_RELEASE);
+
+	if (bucket->orderPrev != NULL)
+		__atomic_store_n(&bucket->orderPrev->orderNext, bucket->orderNext, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&shard->bucketHead, bucket->orderNext, __ATOMIC_RELEASE);
+	if (bucket->orderNext != NULL)
+		bucket->orderNext->orderPrev = bucket->orderPrev;
+	else
+		shard->bucketTail = bucket->orderPrev;
+
+	shard->buckets--;
+	retire(&bucket->columns->rcu);
+	retire(&bucket->rcu);
+}
+
+// Adds the record to its RFC's bucket and to the list of records owned by
+// 'owner', so they can all be found again when the peer leaves. The bucket
+// takes over the record's references to its strings. Only the owner's
+// connection ever touches its record list, so just the shard is locked.
+struct rfcList* addToRfcList(rfc* item, peer* owner)
+{
+	DEBUG("addToRfcList()\n");
+	indexShard *shard = shardFor(item->number);
+	rfcBucket *bucket;
+	bool isNew;
+	int i;
+
+	struct rfcList *ptr = (struct rfcList*)slabAlloc(&rfcNodePool);
+	if(ptr == NULL)
+	{
+		printf("Node creation failed \n");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	bucket = findRfcBucket(shard, item->number);
+	isNew = (bucket == NULL);
+	if (isNew)
+	{
+		bucket = createRfcBucket(item->number);
+	}
+	if (bucket == NULL || ((bucket->columns == NULL || bucket->count == bucket->columns->capacity)
+		&& !growBucket(bucket))) {
+		pthread_mutex_unlock(&shard->lock);
+		if (isNew && bucket != NULL)
+			free(bucket);
+		slabFree(&rfcNodePool, ptr);
+		return NULL;
+	}
+	ptr->bucket = bucket;
+
+	// Put it at the end of this RFC's bucket
+	i = bucket->count;
+	ptr->slot = i;
+	bucket->columns->owners[i] = ptr;
+	beginChange(bucket);
+	storeRecord(bucket->columns, i, item);
+	__atomic_store_n(&bucket->count, i + 1, __ATOMIC_RELEASE);
+	endChange(bucket);
+	if (isNew)
+		publishRfcBucket(shard, bucket);
+	pthread_mutex_unlock(&shard->lock);
+
+	// And at the front of the owning peer's records
+	ptr->ownerNext = owner->rfcs;
+	owner->rfcs = ptr;
+
+	return ptr;
 }
 
 struct peerList* searchInPeerList(char* host, peerList** prev)
@@ -206,206 +1032,85 @@ struct peerList* searchInPeerList(char* host, peerList** prev)
         return NULL;
     }
 }
-struct rfcList* searchInRfcList(int rfcNum, rfcList** prev)
+// Peers are deleted by their list node rather than hostname, since several
+// peers may be running on the same host
+int deleteFromPeerList(peerList* del)
 {
-    struct rfcList *ptr = rfcHead;
-    struct rfcList *tmp = NULL;
-    bool found = false;
-    DEBUG("searchInRfcList()\n");
+    DEBUG("deleteFromPeerList()\n");
 
-    DEBUG("   Searching the list for value [%d] \n", rfcNum);
+    DEBUG("   Deleting socket [%d] from list\n", del->item->socket);
 
-    while(ptr != NULL)
-    {
-        if(ptr->item->number == rfcNum)
-        {
-        	DEBUG("      Found rfc in rfcList\n");
-            found = true;
-            break;
-        }
-        else
-        {
-            tmp = ptr;
-            ptr = ptr->next;
-        }
-    }
+    if(del->prev != NULL)
+        del->prev->next = del->next;
+    else
+        peerHead = del->next;
 
-    if(found == true)
-    {
-    	// save previous in case we need to delete the last item
-        if(prev)
-            *prev = tmp;
-        return ptr;
-    }
+    if(del->next != NULL)
+        del->next->prev = del->prev;
     else
-    {
-        return NULL;
-    }
+        peerTail = del->prev;
+
+    slabFree(&peerPool, del->item);
+    slabFree(&peerNodePool, del);
+    del = NULL;
+
+    return 0;
 }
-struct rfcList* searchPeerInRfcList(char* host, rfcList** prev)
+// This function will walk the records owned by 'owner' and delete ALL of
+// them from the RFC index. Each record's bucket and slot are kept in its
+// entry, so this only costs as much as the RFCs the peer added. Only the
+// record's shard is locked while it is removed, and queries see it gone
+// as soon as it is.
+int deletePeerFromRfcList(peer* owner)
 {
-    struct rfcList *ptr = rfcHead;
-    struct rfcList *tmp = NULL;
-    bool found = false;
-    DEBUG("searchPeerInRfcList()\n");
+	struct rfcList *del, *next;
+	rfcBucket *bucket;
+	indexShard *shard;
+	bool found = false;
+	DEBUG("deletePeerFromRfcList()\n");
 
-    DEBUG("Searching the list for value [%s] \n", host);
+	printf("   Deleting all values [%s] from RFC list\n", owner->hostname);
 
-    while(ptr != NULL)
-    {
-        if(strcmp(ptr->item->peerHostname, host) == 0)
-        {
-            found = true;
-            break;
-        }
-        else
-        {
-            tmp = ptr;
-            ptr = ptr->next;
-        }
-    }
+	for (del = owner->rfcs; del != NULL; del = next)
+	{
+		DEBUG("      Found RFC to delete\n");
+		next = del->ownerNext;
+		bucket = del->bucket;
+		shard = shardFor(bucket->number);
+		found = true;
+
+		pthread_mutex_lock(&shard->lock);
+		removeRecord(bucket, del->slot);
+		if (bucket->count == 0)
+			deleteRfcBucket(shard, bucket);
+		pthread_mutex_unlock(&shard->lock);
+
+		slabFree(&rfcNodePool, del);
+	}
+	owner->rfcs = NULL;
 
-    if(found == true)
-    {
-    	// save previous in case we need to delete the last item
-        if(prev)
-            *prev = tmp;
-        return ptr;
-    }
-    else
-    {
-        return NULL;
-    }
+	if(found == false)
+	{
+		return -1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+int isNumeric(char* String) {
+    char* ptr = String;
+    while(*ptr && isdigit(*ptr))
+        ptr++;
+    return(*ptr ? 0 : 1);
 }
 
-struct peerList* findPeerBySocket(int peerSocket)
+/** Returns 1 on success, or 0 if there was an error */
+int setSocketBlockingEnabled(int fd, int blocking)
 {
-    struct peerList *ptr = peerHead;
-    struct peerList *tmp = NULL;
-    bool found = false;
-    DEBUG("findPeerBySocket()\n");
-
-    DEBUG("Searching the peer list for socket [%d] \n", peerSocket);
-
-    while(ptr != NULL)
-    {
-        if(ptr->item->socket == peerSocket)
-        {
-            found = true;
-            break;
-        }
-        else
-        {
-            ptr = ptr->next;
-        }
-    }
-    
-    if (found == true)
-    {
-    	return ptr;
-    }
-    else {
-    	return NULL;
-    }
-
-}
-
-int deleteFromPeerList(char* host)
-{
-    struct peerList *prev = NULL;
-    struct peerList *del = NULL;
-    DEBUG("deleteFromPeerList()\n");
-
-    DEBUG("   Deleting value [%s] from list\n", host);
-
-    del = searchInPeerList(host, &prev);
-    if(del == NULL)
-    {
-        return -1;
-    }
-    else
-    {
-    	DEBUG("      Found peer to delete\n");
-        if(prev != NULL) {
-        	DEBUG("         Found a previous item in list\n");
-            prev->next = del->next;
-        }
-
-        if(del == peerTail)
-        {
-        	DEBUG("         Deleting Tail\n");
-            peerTail = prev;
-        }
-        
-        if(del == peerHead)
-        {
-        	DEBUG("         Deleting Head\n");
-            peerHead = del->next;
-        }
-    }
-
-	free(del->item);
-    free(del);
-    del = NULL;
-
-    return 0;
-}
-// This function will cycle through the rfcList and delete ALL items
-// with the peerHostname of 'host'
-int deletePeerFromRfcList(char* host)
-{
-    struct rfcList *prev = NULL;
-    struct rfcList *del = NULL;
-    bool found = false;
-    DEBUG("deletePeerFromRfcList()\n");
-
-    printf("   Deleting all values [%s] from RFC list\n", host);
-
-    del = searchPeerInRfcList(host, &prev);
-    while (del != NULL)
-    {
-    	DEBUG("      Found RFC to delete\n");
-    	found = true;
-
-        if(prev != NULL)
-            prev->next = del->next;
-
-        if(del == rfcTail)
-        {
-            rfcTail = prev;
-        }
-        
-        if(del == rfcHead)
-        {
-            rfcHead = del->next;
-        }
-        free(del->item);
-        free(del);
-        del = searchPeerInRfcList(host, &prev);
-    }
-
-    if(found == false)
-    {
-        return -1;
-    }
-	else
-	{
-    	return 0;
-    }
-}
-
-int isNumeric(char* String) {
-    char* ptr = String;
-    while(*ptr && isdigit(*ptr))
-        ptr++;
-    return(*ptr ? 0 : 1);
-}
-
-/** Returns 1 on success, or 0 if there was an error */
-int setSocketBlockingEnabled(int fd, int blocking)
-{
-	DEBUG("setSocketBlockingEnabled()\n");
-	if (fd < 0) return 0;
+	DEBUG("setSocketBlockingEnabled()\n");
+	if (fd < 0) return 0;
 
 	int flags = fcntl(fd, F_GETFL, 0);
 	if (flags < 0) return 0;
@@ -414,114 +1119,189 @@ int setSocketBlockingEnabled(int fd, int blocking)
 }
 
 
-void handleClientDisconnect(int clientNum)
+void deleteFromHandshakeList(connection* conn);
+void deleteFromReadyList(connection* conn);
+
+void handleClientDisconnect(connection* conn)
 {
-	struct peerList *tmpList;
 	DEBUG("handleClientDisconnect()\n");
 	
-	tmpList = findPeerBySocket(clientList[clientNum]);
-	if (tmpList != NULL) {
+	deleteFromReadyList(conn);
+	if (conn->state != CONN_READY) {
+		// Never finished registering, so there is nothing in the lists yet
+		deleteFromHandshakeList(conn);
+		slabFree(&peerPool, conn->pending);
+	}
+	else if (conn->peer != NULL) {
 		// Delete all of the disconnected peer's rfc data
-		deletePeerFromRfcList(tmpList->item->hostname);
+		deletePeerFromRfcList(conn->peer->item);
 		// Now remove it from the list of connected peers
-		deleteFromPeerList(tmpList->item->hostname);
-		// Then close the connection to the peer
-		close(clientList[clientNum]);
-		// And remove it from the client list
-		clientList[clientNum] = 0;
-		printf("Client %d has disconnected\n", clientNum);
+		pthread_mutex_lock(&peerListLock);
+		deleteFromPeerList(conn->peer);
+		pthread_mutex_unlock(&peerListLock);
 	}
 	else {
 		printf("   ERROR: Client not found!\n");
 	}
+	// Then close the connection to the peer, which also removes it from epoll
+	close(conn->socket);
+	free(conn->readBuf);
+	while (conn->outHead != NULL) {
+		outChunk *next = conn->outHead->next;
+		free(conn->outHead);
+		conn->outHead = next;
+	}
+	printf("Client %d has disconnected\n", conn->socket);
+	free(conn);
+}
+
+// Returns true if 'view' holds exactly the string 'str'
+bool viewEquals(strView view, const char* str)
+{
+	return (strncmp(view.ptr, str, view.len) == 0 && str[view.len] == '\0');
+}
+
+// Converts a view of decimal digits to an int. Returns 0 if it is empty or
+// has anything other than digits in it.
+int viewToInt(strView view, int* result)
+{
+	int i, value = 0;
+
+	if (view.len == 0 || view.len > 9) {
+		return 0;
+	}
+	for (i = 0; i < view.len; i++) {
+		if (!isdigit((unsigned char)view.ptr[i]))
+			return 0;
+		value = value * 10 + (view.ptr[i] - '0');
+	}
+	*result = value;
+	return 1;
 }
 
-// This updates the list of socket connections that select() will wake on
-// Our listenSocket as well as any connected clients will be added
-void updateSelectList()
+// Converts a checksum token ("crc32:" and 8 hex digits) to its value.
+// Returns 0 if the view is not one.
+int viewToChecksum(strView view, uint32_t* result)
 {
+	int prefixLen = strlen(CHECKSUM_PREFIX);
 	int i;
-	DEBUG("updateSelectList()\n");
-	FD_ZERO(&readset);
-	FD_SET(listenSocket, &readset);
-	maxfd = listenSocket;
-	
-	for (i = 0; i < MAX_CLIENTS; i++) {
-		if (clientList[i] != 0) {
-			DEBUG("   Adding socket %d in position %d\n", clientList[i], i);
-			FD_SET(clientList[i], &readset);
-			maxfd = (clientList[i] > maxfd) ? clientList[i] : maxfd;
-			DEBUG("   maxfd = %d\n", maxfd);
-		}
+	uint32_t value = 0;
+
+	if (view.len != prefixLen + 8 || strncmp(view.ptr, CHECKSUM_PREFIX, prefixLen) != 0) {
+		return 0;
 	}
+	for (i = prefixLen; i < view.len; i++) {
+		if (!isxdigit((unsigned char)view.ptr[i]))
+			return 0;
+		value = (value << 4) | (isdigit((unsigned char)view.ptr[i]) ? view.ptr[i] - '0'
+			: tolower((unsigned char)view.ptr[i]) - 'a' + 10);
+	}
+	*result = value;
+	return 1;
 }
 
-char* getTagValue(char *data, char *tag)
+// Returns the next line of 'data' (without its line ending) and moves
+// 'cursor' past it. Lines may end in any mix of \r and \n. Returns false when
+// there are no lines left.
+bool nextLine(char** cursor, char* end, strView* line)
 {
-	char *datacopy = malloc(strlen(data) + 1); // strtok modifies the string
-	char *result = 0;
-	char *s;
-	DEBUG("getTagValue() - %s\n", tag);
-	
-	strcpy(datacopy, data);
-	
-	s = strtok(datacopy, " \n\r");
-	
-	while (s)
-	{
-		if (strcmp(s, tag) == 0)
-		{
-			// When looking for title, it can have spaces, so do not
-			// add " " as a delimiter.
-			if (strcmp(tag, "Title:") == 0) {
-				s = strtok(0, "\n\r");
-			}
-			else {
-				s = strtok(0, " \n\r"); // the next token should be our value
-			}
-			DEBUG("      found value - [%s]\n", s);
-			result = malloc(strlen(s) +1);
-			strcpy(result, s);
-			free(datacopy);
-			return result;
-		}
-		s = strtok(0, " \n\r");
+	char *p = *cursor;
+
+	while (p < end && (*p == '\r' || *p == '\n'))
+		p++;
+	if (p >= end)
+		return false;
+	line->ptr = p;
+	while (p < end && *p != '\r' && *p != '\n')
+		p++;
+	line->len = p - line->ptr;
+	*cursor = p;
+	return true;
+}
+
+// Returns the next space separated token of 'line' and moves past it
+strView nextToken(strView* line)
+{
+	strView token;
+
+	while (line->len > 0 && *line->ptr == ' ') {
+		line->ptr++;
+		line->len--;
 	}
-	free(datacopy);
-	
-	return result;
+	token.ptr = line->ptr;
+	while (line->len > 0 && *line->ptr != ' ') {
+		line->ptr++;
+		line->len--;
+	}
+	token.len = line->ptr - token.ptr;
+	return token;
 }
 
-char* getTagVersion(char *data, int versionPosition)
+// Parses a request in one pass over the data:
+//
+// method <sp> RFC number <sp> version <cr> <lf>
+// header field name <sp> value <cr> <lf>
+// ...
+//
+// LIST and BULKADD have no RFC number ("LIST ALL P2P-CI/1.0"), so the word in
+// its place is kept in rfcNumber instead. Only the headers the server uses
+// (Host, Port, Title and Checksum) are kept.
+void parseRequest(char* data, int len, request* req)
 {
-	char *datacopy = malloc(strlen(data) + 1); // strtok modifies the string
-	char *version;
-	char *result = 0;
-	DEBUG("getTagVersion() - version at %d\n", versionPosition);
-	
-	strcpy(datacopy, data);
-	
-	version = strtok(datacopy, " \r\n");
-	versionPosition--;
-	
-	// we know the version is the nth token position based on
-	// versionPosition passed in
-	while (versionPosition)
+	char *cursor = data;
+	char *end = data + len;
+	strView line, name, word;
+	DEBUG("parseRequest()\n");
+
+	memset(req, 0, sizeof(request));
+
+	// Request line
+	if (!nextLine(&cursor, end, &line)) {
+		return;
+	}
+	req->method = nextToken(&line);
+	word = nextToken(&line);
+	if (viewEquals(word, "RFC")) {
+		word = nextToken(&line);
+	}
+	req->rfcNumber = word;
+	req->version = nextToken(&line);
+	req->headers.ptr = cursor;
+	req->headers.len = end - cursor;
+
+	// Header lines
+	while (nextLine(&cursor, end, &line))
 	{
-		version = strtok(0, " \r\n");
-		versionPosition--;
+		name = nextToken(&line);
+		// The value is the rest of the line. Titles can have spaces.
+		while (line.len > 0 && *line.ptr == ' ') {
+			line.ptr++;
+			line.len--;
+		}
+		while (line.len > 0 && line.ptr[line.len - 1] == ' ') {
+			line.len--;
+		}
+		if (viewEquals(name, "Host:"))
+			req->host = line;
+		else if (viewEquals(name, "Port:"))
+			req->port = line;
+		else if (viewEquals(name, "Title:"))
+			req->title = line;
+		else if (viewEquals(name, "Checksum:"))
+			req->checksum = line;
 	}
-	
-	result = malloc(strlen(version) + 1);
-	strcpy(result, version);
-	free(datacopy);
-	
-	return result;
+	DEBUG("   Method = %.*s\n", req->method.len, req->method.ptr);
+	DEBUG("   RFC = %.*s\n", req->rfcNumber.len, req->rfcNumber.ptr);
+	DEBUG("   Version = %.*s\n", req->version.len, req->version.ptr);
+	DEBUG("   Host = %.*s\n", req->host.len, req->host.ptr);
+	DEBUG("   Port = %.*s\n", req->port.len, req->port.ptr);
+	DEBUG("   Title = %.*s\n", req->title.len, req->title.ptr);
+	DEBUG("   Checksum = %.*s\n", req->checksum.len, req->checksum.ptr);
 }
 
-int isVersionOk(char *version) {
+int isVersionOk(strView version) {
 	DEBUG("isVersionOk()\n");
-	if (strcmp(version, "P2P-CI/1.0") == 0) {
+	if (viewEquals(version, "P2P-CI/1.0")) {
 		//they match
 		return 1;
 	}
@@ -530,374 +1310,1000 @@ int isVersionOk(char *version) {
 	}
 }
 
-void send400(int clientNum) {
+// Returns space for at least 'len' bytes at the end of the connection's
+// output, adding a chunk to the chain if the last one is full. Call
+// commitOutput() with the number of bytes actually written.
+char* reserveOutput(connection* conn, int len)
+{
+	outChunk *chunk = conn->outTail;
+	int cap;
+
+	if (chunk == NULL || chunk->cap - chunk->len < len) {
+		cap = (len > OUT_CHUNK_SIZE) ? len : OUT_CHUNK_SIZE;
+		chunk = (outChunk*)malloc(sizeof(outChunk) + cap);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = NULL;
+		chunk->cap = cap;
+		chunk->len = chunk->sent = 0;
+		if (conn->outTail != NULL)
+			conn->outTail->next = chunk;
+		else
+			conn->outHead = chunk;
+		conn->outTail = chunk;
+	}
+	return &chunk->data[chunk->len];
+}
+
+void commitOutput(connection* conn, int len)
+{
+	conn->outTail->len += len;
+	conn->outQueued += len;
+}
+
+// Appends 'len' bytes to the connection's output
+void queueOutput(connection* conn, const char* data, int len)
+{
+	char *dest = reserveOutput(conn, len);
+	if (dest == NULL) {
+		printf("   ERROR: No memory for reply to client %d\n", conn->socket);
+		return;
+	}
+	memcpy(dest, data, len);
+	commitOutput(conn, len);
+}
+
+// Appends printf style output. Only for short replies; 'maxLen' must be
+// at least as long as the formatted text.
+void queuePrintf(connection* conn, int maxLen, const char* format, ...)
+{
+	va_list args;
+	char *dest = reserveOutput(conn, maxLen + 1);
+	if (dest == NULL) {
+		printf("   ERROR: No memory for reply to client %d\n", conn->socket);
+		return;
+	}
+	va_start(args, format);
+	commitOutput(conn, vsnprintf(dest, maxLen + 1, format, args));
+	va_end(args);
+}
+
+// Sends as much queued output as the socket will take. Whatever is left is
+// sent when epoll reports the socket writable again. Returns 0 if the
+// connection failed and should be dropped.
+int flushOutput(connection* conn)
+{
+	outChunk *chunk;
+	int len;
+
+	while ((chunk = conn->outHead) != NULL)
+	{
+		if (chunk->sent < chunk->len) {
+			len = send(conn->socket, &chunk->data[chunk->sent], chunk->len - chunk->sent, 0);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1; // socket is full, wait for EPOLLOUT
+				perror("send");
+				return 0;
+			}
+			chunk->sent += len;
+			conn->outQueued -= len;
+			if (chunk->sent < chunk->len)
+				continue;
+		}
+		// All of this chunk is sent. Idle peers hold no output memory.
+		conn->outHead = chunk->next;
+		if (conn->outHead == NULL)
+			conn->outTail = NULL;
+		free(chunk);
+	}
+	return 1;
+}
+
+void send400(connection* conn) {
 	DEBUG("send400()\n");
 	char message[] = "P2P-CI/1.0 400 Bad Request\r\n\r\n";
 	
 	printf("\nSending 400 message:\n%s\n", message);
-	send(clientList[clientNum], message, strlen(message), 0);
+	queueOutput(conn, message, strlen(message));
 }
 
-void send404(int clientNum) {
+void send404(connection* conn) {
 	DEBUG("send404()\n");
 	char message[] = "P2P-CI/1.0 404 P2P-CI Not Found\r\n\r\n";
 	
 	printf("\nSending 404 message:\n%s\n", message);
-	send(clientList[clientNum], message, strlen(message), 0);
+	queueOutput(conn, message, strlen(message));
 }
 
-void send505(int clientNum) {
+void send505(connection* conn) {
 	DEBUG("send505()\n");
 	char message[] = "P2P-CI/1.0 505 P2P-CI Version Not Supported\r\n\r\n";
 	
 	printf("\nSending 505 message:\n%s\n", message);
-	send(clientList[clientNum], message, strlen(message), 0);
+	queueOutput(conn, message, strlen(message));
 }
 
-void sendRfcQueryResponse(rfcList* resultList, int clientNum)
+// Writes the row for one record: "RFC <number> <title> <hostname> <port>",
+// followed by " crc32:<8 hex digits>" if the peer registered a checksum and
+// " addr:<dotted quad>" with the peer's address. Returns the length of the
+// row.
+int formatRow(char* row, rfc* item)
 {
-	DEBUG("sendRfcQueryResponse()\n");
-	char replyMessage[MAX_MSG_SIZE];
-	char rfcNumString[10];
-	char portNumString[10];
-	memset(&replyMessage, 0, MAX_MSG_SIZE);
-	
-	if (resultList == NULL) {
-		// Nothing was found
-		send404(clientNum);
+	int len = sprintf(row, "RFC %d %s %s %d", item->number, item->title, item->peerHostname, item->port);
+	if (item->hasChecksum) {
+		len += sprintf(&row[len], " %s%08x", CHECKSUM_PREFIX, item->checksum);
 	}
-	else {
-		strcpy(replyMessage, "P2P-CI/1.0 200 OK\r\n");
-		while (resultList != NULL) {
-			sprintf(rfcNumString, "%d", resultList->item->number);
-			sprintf(portNumString, "%d", resultList->item->port);
-			strcat(replyMessage, "RFC ");
-			strcat(replyMessage, rfcNumString);
-			strcat(replyMessage, " ");
-			strcat(replyMessage, resultList->item->title);
-			strcat(replyMessage, " ");
-			strcat(replyMessage, resultList->item->peerHostname);
-			strcat(replyMessage, " ");
-			strcat(replyMessage, portNumString);
-			strcat(replyMessage, "\r\n");
-			resultList = resultList->next;
+	if (sendAddresses && item->address.s_addr != 0) {
+		len += sprintf(&row[len], " %s", ADDRESS_PREFIX);
+		inet_ntop(AF_INET, &item->address, &row[len], INET_ADDRSTRLEN);
+		len += strlen(&row[len]);
+	}
+	return len;
+}
+
+// Formats the rows for every record in 'bucket' into 'rowBuf', a sweep down
+// its columns, and returns their length. No lock is taken: if a writer
+// changed the bucket meanwhile, the rows are formatted again. 'changes' is
+// set to the bucket's count of changes the rows are up to date with.
+// Returns -1 if there is no memory.
+int formatBucketRows(rfcBucket* bucket, unsigned int* changes)
+{
+	recordColumns *cols;
+	unsigned int seen;
+	rfc item;
+	int count, len, i;
+	char *grown;
+
+	do {
+		len = 0;
+		seen = __atomic_load_n(&bucket->changes, __ATOMIC_ACQUIRE);
+		if (seen & 1)
+			continue; // a writer is half way through, try again
+		cols = __atomic_load_n(&bucket->columns, __ATOMIC_ACQUIRE);
+		count = __atomic_load_n(&bucket->count, __ATOMIC_ACQUIRE);
+		if (cols == NULL)
+			count = 0;
+		else if (count > cols->capacity)
+			count = cols->capacity; // the columns grew under us
+		if (count * MAX_ROW_SIZE > rowBufCap) {
+			grown = (char*)realloc(rowBuf, count * MAX_ROW_SIZE);
+			if (grown == NULL)
+				return -1;
+			rowBuf = grown;
+			rowBufCap = count * MAX_ROW_SIZE;
+		}
+		for (i = 0; i < count; i++) {
+			loadRecord(bucket, cols, i, &item);
+			len += formatRow(&rowBuf[len], &item);
+			rowBuf[len++] = '\r';
+			rowBuf[len++] = '\n';
 		}
-		strcat(replyMessage, "\r\n");
-		send(clientList[clientNum], replyMessage, strlen(replyMessage), 0);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seen & 1) || __atomic_load_n(&bucket->changes, __ATOMIC_RELAXED) != seen);
+	*changes = seen;
+	return len;
+}
+
+// Queues the rows for every record in 'bucket', from its formatted rows if
+// they are up to date. If 'keep' is set, rows that had to be formatted are
+// kept for the next query.
+void queueBucketRows(rfcBucket* bucket, connection* conn, bool keep)
+{
+	rowCache *rows = __atomic_load_n(&bucket->rows, __ATOMIC_ACQUIRE);
+	rowCache *fresh;
+	unsigned int changes;
+	int len;
+
+	if (rows != NULL && rows->changes == __atomic_load_n(&bucket->changes, __ATOMIC_ACQUIRE)) {
+		queueOutput(conn, rows->data, rows->len);
+		return;
+	}
+	len = formatBucketRows(bucket, &changes);
+	if (len < 0) {
+		printf("   ERROR: No memory for reply to client %d\n", conn->socket);
+		return;
 	}
+	queueOutput(conn, rowBuf, len);
+	// An empty bucket is being deleted, and its rows would never be freed
+	if (!keep || len == 0 || (fresh = (rowCache*)malloc(sizeof(rowCache) + len)) == NULL)
+		return;
+	fresh->changes = changes;
+	fresh->len = len;
+	memcpy(fresh->data, rowBuf, len);
+
+	// Whoever takes a copy out of 'rows' retires it
+	if (!__atomic_compare_exchange_n(&bucket->rows, &rows, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(fresh);
+		return;
+	}
+	if (rows != NULL)
+		retire(&rows->rcu);
+	// A writer may have dropped the rows just before we put these in, and
+	// then nobody else would take them out
+	if (__atomic_load_n(&bucket->changes, __ATOMIC_ACQUIRE) != changes
+		&& __atomic_compare_exchange_n(&bucket->rows, &fresh, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		retire(&fresh->rcu);
 }
 
-void add(char* data, int clientNum)
+void add(request* req, connection* conn)
 {
 	DEBUG("add()\n");
 	int rfcNum;
-	char *rfcNumString;
-	char *host;
-	char *version;
 	int port;
-	char *portString;
-	char *title;
-	char replyMessage[MAX_MSG_SIZE];
-	memset(&replyMessage, 0, MAX_MSG_SIZE);
-	struct rfc* newRfc = (struct rfc*)malloc(sizeof(struct rfc));
-
-	rfcNumString = getTagValue(data, "RFC");    DEBUG("   RFC = %s\n", rfcNumString);
-	version      = getTagVersion(data, 4);      DEBUG("   Version = %s\n", version);
-	host         = getTagValue(data, "Host:");  DEBUG("   Host = %s\n", host);
-	portString   = getTagValue(data, "Port:");  DEBUG("   Port = %s\n", portString);
-	title        = getTagValue(data, "Title:"); DEBUG("   Title = %s\n", title);
-	
+	struct peerList *owner;
+	struct rfc newRfc;
+	uint32_t checksum = 0;
+	char row[MAX_ROW_SIZE];
+
 	// Check version
-	if (!isVersionOk(version)) {
-		send505(clientNum);
+	if (!isVersionOk(req->version)) {
+		send505(conn);
 		return;
 	}
 	
-	newRfc->number = atoi(rfcNumString);
-	newRfc->port   = atoi(portString);
-	strcpy(newRfc->peerHostname, host);
-	strcpy(newRfc->title, title);
+	// The record belongs to the peer on this connection, which may not be
+	// the Host: it claims
+	owner = conn->peer;
+	if (owner == NULL || !viewToInt(req->rfcNumber, &rfcNum) || !viewToInt(req->port, &port)
+		|| req->host.len == 0 || req->title.len == 0
+		|| (req->checksum.len > 0 && !viewToChecksum(req->checksum, &checksum))) {
+		printf("   ERROR: Incomplete ADD from client %d\n", conn->socket);
+		send400(conn);
+		return;
+	}
 	
-	addToRfcList(newRfc);
+	newRfc.number = rfcNum;
+	newRfc.port   = port;
+	newRfc.peerHostname = internText(req->host.ptr, req->host.len);
+	newRfc.title = internText(req->title.ptr, req->title.len);
+	newRfc.hasChecksum = (req->checksum.len > 0);
+	newRfc.checksum = checksum;
+	newRfc.address = owner->item->address;
+	
+	if (newRfc.peerHostname == NULL || newRfc.title == NULL
+		|| addToRfcList(&newRfc, owner->item) == NULL) {
+		releaseRfcText(&newRfc);
+		send400(conn);
+		return;
+	}
 	
 	// Send OK reply
-	strcpy(replyMessage, "P2P-CI/1.0 200 OK\r\nRFC ");
-	strcat(replyMessage, rfcNumString);
-	strcat(replyMessage, " ");
-	strcat(replyMessage, title);
-	strcat(replyMessage, " ");
-	strcat(replyMessage, host);
-	strcat(replyMessage, " ");
-	strcat(replyMessage, portString);
-	strcat(replyMessage, "\r\n\r\n");
-	send(clientList[clientNum], replyMessage, strlen(replyMessage), 0);
+	formatRow(row, &newRfc);
+	queuePrintf(conn, MAX_ROW_SIZE + 20, "P2P-CI/1.0 200 OK\r\n%s\r\n\r\n", row);
 }
 
-void lookup(char* data, int clientNum)
+// BULKADD registers a whole catalog of RFCs in one request:
+//
+// BULKADD ALL P2P-CI/1.0
+// Host: <hostname>
+// Port: <upload port>
+// RFC <number> <title> [crc32:<checksum>]
+// RFC <number> <title> [crc32:<checksum>]
+// ...
+//
+// Every row is added to the index as it is read, and the peer gets a single
+// reply saying how many rows were added and how many were not valid:
+//
+// P2P-CI/1.0 200 OK
+// Added: <count>
+// Rejected: <count>
+void bulkAdd(request* req, connection* conn)
+{
+	DEBUG("bulkAdd()\n");
+	char *cursor = req->headers.ptr;
+	char *end = req->headers.ptr + req->headers.len;
+	strView line, word, last;
+	int rfcNum, port;
+	int added = 0, rejected = 0;
+	struct rfc newRfc;
+	uint32_t checksum;
+	bool hasChecksum;
+	const char *host;
+
+	// Check version
+	if (!isVersionOk(req->version)) {
+		send505(conn);
+		return;
+	}
+	if (req->host.len == 0 || !viewToInt(req->port, &port) || conn->peer == NULL) {
+		printf("   ERROR: BULKADD without Host/Port or from unregistered client %d\n", conn->socket);
+		send400(conn);
+		return;
+	}
+	// Every row shares the one hostname
+	host = internText(req->host.ptr, req->host.len);
+	if (host == NULL) {
+		send400(conn);
+		return;
+	}
+
+	// One pass over the rows. The header lines are skipped.
+	while (nextLine(&cursor, end, &line))
+	{
+		word = nextToken(&line);
+		if (!viewEquals(word, "RFC")) {
+			continue; // a header
+		}
+		word = nextToken(&line);
+		if (line.len > 0) {
+			// Drop the space between the number and the title
+			line.ptr++;
+			line.len--;
+		}
+		// A checksum, if there is one, is the last word of the title
+		last.ptr = line.ptr + line.len;
+		while (last.ptr > line.ptr && last.ptr[-1] != ' ')
+			last.ptr--;
+		last.len = line.ptr + line.len - last.ptr;
+		hasChecksum = (last.ptr > line.ptr && viewToChecksum(last, &checksum));
+		if (hasChecksum) {
+			line.len = last.ptr - line.ptr - 1;
+		}
+		if (!viewToInt(word, &rfcNum) || line.len == 0) {
+			rejected++;
+			continue;
+		}
+
+		newRfc.number = rfcNum;
+		newRfc.port   = port;
+		newRfc.peerHostname = host;
+		retainText(host);
+		newRfc.title = internText(line.ptr, line.len);
+		newRfc.hasChecksum = hasChecksum;
+		newRfc.checksum = hasChecksum ? checksum : 0;
+		newRfc.address = conn->peer->item->address;
+
+		if (newRfc.title == NULL || addToRfcList(&newRfc, conn->peer->item) == NULL) {
+			releaseRfcText(&newRfc);
+			rejected++;
+			continue;
+		}
+		added++;
+	}
+	releaseText(host);
+	printf("   Bulk added %d RFCs (%d rejected) for %.*s\n", added, rejected, req->host.len, req->host.ptr);
+
+	// Send one summary reply for the whole batch
+	queuePrintf(conn, 80, "P2P-CI/1.0 200 OK\r\nAdded: %d\r\nRejected: %d\r\n\r\n", added, rejected);
+}
+
+void lookup(request* req, connection* conn)
 {
 	DEBUG("lookup()\n");
 	int rfcNum;
-	char *rfcNumString;
-	char *host;
-	char *version;
-	int port;
-	char *portString;
-	char *title;
-	char reply[MAX_MSG_SIZE];
-	rfcList *resultList = (struct rfcList*)malloc(sizeof(struct rfcList));
-	rfcList *currList = NULL;
-
-	rfcNumString = getTagValue(data, "RFC");    DEBUG("   RFC = %s\n", rfcNumString);
-	version      = getTagVersion(data, 4);      DEBUG("   Version = %s\n", version);
-	host         = getTagValue(data, "Host:");  DEBUG("   Host = %s\n", host);
-	portString   = getTagValue(data, "Port:");  DEBUG("   Port = %s\n", portString);
-	title        = getTagValue(data, "Title:"); DEBUG("   Title = %s\n", title);
-	rfcNum = atoi(rfcNumString);
+	indexShard *shard;
+	rfcBucket *bucket;
 
 	// Check version
-	if (!isVersionOk(version)) {
-		send505(clientNum);
+	if (!isVersionOk(req->version)) {
+		send505(conn);
+		return;
+	}
+	if (!viewToInt(req->rfcNumber, &rfcNum)) {
+		send400(conn);
 		return;
 	}
 	
-	strcpy(&reply, version);
-	// Look through the entire rfcList for this RFC
-	struct rfcList *ptr = rfcHead;
-    bool found = false;
-
-    DEBUG("   Searching the list for value [%d] \n", rfcNum);
+	// The bucket for this RFC number holds every peer that has it
+	shard = shardFor(rfcNum);
+	bucket = findRfcBucket(shard, rfcNum);
+	if (bucket == NULL || __atomic_load_n(&bucket->count, __ATOMIC_ACQUIRE) == 0) {
+		// Nothing was found, or the last holder just left
+		send404(conn);
+	}
+	else {
+		queueOutput(conn, "P2P-CI/1.0 200 OK\r\n", 19);
+		queueBucketRows(bucket, conn, true);
+		queueOutput(conn, "\r\n", 2);
+	}
+}
 
-    while(ptr != NULL)
-    {
-        if(ptr->item->number == rfcNum)
-        {
-        	DEBUG("      Found rfc in rfcList\n");
-        	// Add this rfc to the reply
-        	if (found == false) {
-        		// add as the first RFC found
-        		resultList->item = ptr->item;
-        		resultList->next = NULL;
-        		currList = resultList;
-        		found = true;
-        	}
-        	else {
-        		currList->next = (struct rfcList*)malloc(sizeof(struct rfcList));
-        		currList = currList->next;
-        		currList->item = ptr->item;
-        		currList->next = NULL;
-        	}
-            
-            ptr = ptr->next;
-        }
-        else
-        {
-            ptr = ptr->next;
-        }
-    }
+// Finds the bucket after the last one a LIST sent from 'shard'. That bucket
+// is looked up again by number, and if it has gone since, the buckets that
+// were created before it are skipped instead.
+rfcBucket* nextListBucket(indexShard* shard, int number, unsigned long serial)
+{
+	rfcBucket *bucket;
 
-	if (found == false) {
-		sendRfcQueryResponse(NULL, clientNum);
+	if (serial != 0) {
+		bucket = findRfcBucket(shard, number);
+		if (bucket != NULL && bucket->serial == serial)
+			return __atomic_load_n(&bucket->orderNext, __ATOMIC_ACQUIRE);
 	}
-	else 
-	{
-	    sendRfcQueryResponse(resultList, clientNum);
+	bucket = __atomic_load_n(&shard->bucketHead, __ATOMIC_ACQUIRE);
+	while (bucket != NULL && bucket->serial <= serial) {
+		bucket = __atomic_load_n(&bucket->orderNext, __ATOMIC_ACQUIRE);
 	}
+	return bucket;
 }
 
-void list(char* data, int clientNum)
+// Queues more of a LIST reply, a bucket at a time, until outHighWater bytes
+// are waiting for the peer or the index has all been sent.
+void continueList(connection* conn)
 {
-	DEBUG("list()\n");
-	char *version;
-	char reply[MAX_MSG_SIZE];
+	indexShard *shard;
+	rfcBucket *bucket;
+
+	for (; conn->listShard < INDEX_SHARDS; conn->listShard++, conn->listSerial = 0) {
+		shard = &shards[conn->listShard];
+		bucket = nextListBucket(shard, conn->listNumber, conn->listSerial);
+		for (; bucket != NULL; bucket = __atomic_load_n(&bucket->orderNext, __ATOMIC_ACQUIRE)) {
+			queueBucketRows(bucket, conn, false);
+			conn->listNumber = bucket->number;
+			conn->listSerial = bucket->serial;
+			if (conn->outQueued >= outHighWater)
+				return;
+		}
+	}
+	queueOutput(conn, "\r\n", 2);
+	conn->listing = false;
+}
 
-	version      = getTagVersion(data, 3);      DEBUG("   Version = %s\n", version);
+// Sends a row for every record in the index, one shard at a time. No lock
+// is taken, so a long LIST does not hold up ADDs; buckets added or removed
+// meanwhile may or may not be listed. Only as much as fits under
+// outHighWater is queued now, and continueList() queues the rest as the
+// peer takes it.
+void list(request* req, connection* conn)
+{
+	DEBUG("list()\n");
+	bool found = false;
+	int i;
 
 	// Check version
-	if (!isVersionOk(version)) {
-		send505(clientNum);
+	if (!isVersionOk(req->version)) {
+		send505(conn);
 		return;
 	}
 	
-	// Sending rfcHead will send ALL RFCs on the server
-	sendRfcQueryResponse(rfcHead, clientNum);
+	for (i = 0; i < INDEX_SHARDS && !found; i++) {
+		found = (__atomic_load_n(&shards[i].bucketHead, __ATOMIC_ACQUIRE) != NULL);
+	}
+	if (!found) {
+		// The index is empty
+		send404(conn);
+		return;
+	}
+	queueOutput(conn, "P2P-CI/1.0 200 OK\r\n", 19);
+	conn->listing = true;
+	conn->listShard = 0;
+	conn->listSerial = 0;
+	continueList(conn);
+}
+
+long long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void addToHandshakeList(connection* conn)
+{
+	DEBUG("addToHandshakeList()\n");
+	conn->deadline = nowMs() + HANDSHAKE_TIMEOUT * 1000;
+	conn->handshakeNext = NULL;
+	conn->handshakePrev = handshakeTail;
+	if (handshakeTail != NULL)
+		handshakeTail->handshakeNext = conn;
+	else
+		handshakeHead = conn;
+	handshakeTail = conn;
+}
+
+void deleteFromHandshakeList(connection* conn)
+{
+	DEBUG("deleteFromHandshakeList()\n");
+	if (conn->handshakePrev != NULL)
+		conn->handshakePrev->handshakeNext = conn->handshakeNext;
+	else
+		handshakeHead = conn->handshakeNext;
+	if (conn->handshakeNext != NULL)
+		conn->handshakeNext->handshakePrev = conn->handshakePrev;
+	else
+		handshakeTail = conn->handshakePrev;
+	conn->handshakePrev = conn->handshakeNext = NULL;
+}
+
+int sendAck(connection* conn);
+
+// Drops every connection whose registration deadline has passed, so a peer
+// that connects and never sends its hostname only ties up a socket briefly
+void expireHandshakes()
+{
+	long long now = nowMs();
+	connection* conn;
+	DEBUG("expireHandshakes()\n");
+
+	while (handshakeHead != NULL && handshakeHead->deadline <= now) {
+		conn = handshakeHead;
+		if (conn->state == CONN_WAIT_HOSTNAME && conn->received > 0) {
+			// Clients from before the hostname gained its NUL send the
+			// bare name and wait for the ack. Take what came and give
+			// them a fresh deadline for the port.
+			deleteFromHandshakeList(conn);
+			if (!sendAck(conn)) {
+				perror("send");
+				handleClientDisconnect(conn);
+				continue;
+			}
+			conn->pending->hostname[conn->received] = '\0';
+			DEBUG("   Received host [%s]\n", conn->pending->hostname);
+			conn->received = 0;
+			conn->state = CONN_WAIT_PORT;
+			addToHandshakeList(conn);
+			continue;
+		}
+		printf("   Client %d did not register in time\n", conn->socket);
+		handleClientDisconnect(conn);
+	}
+}
 
+// Registration acks are a single 'A'. Returns 1 on success.
+int sendAck(connection* conn)
+{
+	queueOutput(conn, "A", 1);
+	return flushOutput(conn);
+}
+
+void handleData(connection* conn);
+int handleWritable(connection* conn);
+
+// Moves a new connection through registration as its data arrives:
+//   CONN_WAIT_HOSTNAME - peer sends its hostname and a NUL, we ack with 'A'
+//   CONN_WAIT_PORT     - peer sends its upload port, we ack with 'A'
+// after which the peer is added to the peerList. Nothing here blocks, so a
+// slow or silent peer never holds up the others.
+void handleHandshake(connection* conn)
+{
+	int len;
+	bool stepDone;
+	char *hostname, *end;
+	DEBUG("handleHandshake() from client %d\n", conn->socket);
+
+	while (conn->state != CONN_READY)
+	{
+		if (conn->state == CONN_WAIT_HOSTNAME) {
+			// Peek first and then take only up to the NUL, so a request
+			// sent right behind the handshake stays in the socket
+			hostname = &conn->pending->hostname[conn->received];
+			len = recv(conn->socket, hostname, LEN - 1 - conn->received, MSG_PEEK);
+			if (len > 0) {
+				end = memchr(hostname, '\0', len);
+				if (end != NULL)
+					len = end - hostname + 1;
+				len = recv(conn->socket, hostname, len, 0);
+			}
+		}
+		else {
+			// Only read the port itself. Anything after it is a request.
+			len = recv(conn->socket, (char*)&conn->portBuf + conn->received, sizeof(conn->portBuf) - conn->received, 0);
+		}
+
+		if (len == 0) {
+			printf("   Close from client %d\n", conn->socket);
+			handleClientDisconnect(conn);
+			return;
+		}
+		stepDone = false;
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("recv");
+				handleClientDisconnect(conn);
+				return;
+			}
+			return; // wait for more data
+		}
+		else if (conn->state == CONN_WAIT_HOSTNAME) {
+			// The hostname ends with a NUL, and may come in several
+			// pieces on a slow link. One that fills the buffer is cut short.
+			stepDone = (conn->pending->hostname[conn->received + len - 1] == '\0');
+			conn->received += len;
+			if (conn->received == LEN - 1)
+				stepDone = true;
+		}
+		else {
+			conn->received += len;
+			stepDone = (conn->received == sizeof(conn->portBuf));
+		}
+		if (!stepDone) {
+			continue;
+		}
+
+		if (!sendAck(conn)) {
+			perror("send");
+			handleClientDisconnect(conn);
+			return;
+		}
+		conn->received = 0;
+		if (conn->state == CONN_WAIT_HOSTNAME) {
+			DEBUG("   Received host [%s]\n", conn->pending->hostname);
+			conn->state = CONN_WAIT_PORT;
+		}
+		else {
+			conn->pending->port = ntohl(conn->portBuf);
+			DEBUG("   Received port [%d]\n", conn->pending->port);
+			conn->pending->socket = conn->socket;
+
+			// Add the new peer to the peerList
+			deleteFromHandshakeList(conn);
+			pthread_mutex_lock(&peerListLock);
+			conn->peer = addToPeerList(conn->pending);
+			pthread_mutex_unlock(&peerListLock);
+			conn->pending = NULL;
+			conn->state = CONN_READY;
+		}
+	}
+
+	// The socket is edge triggered, so any requests the peer already sent
+	// behind its port will not raise another event. Read them now.
+	handleData(conn);
 }
 
 void handleNewClient()
 {
-	int i, len;
-	int socketSaved = 0;
 	int newSocket; /* Socket file descriptor for incoming connections */
+	struct sockaddr_in from;
+	socklen_t fromLen;
+	struct epoll_event event;
+	connection *conn;
 
 	DEBUG("handleNewClient()\n");
-	// New client is connecting. Look for a spot in the clientList
-	newSocket = accept(listenSocket, NULL, NULL);
-	if (newSocket < 0) {
-		perror("accept");
-		exit(listenSocket);
-	}
-	for (i = 0; (i < MAX_CLIENTS) && (socketSaved == 0); i++) {
-		if (clientList[i] == 0) {
-			DEBUG("   Client accepted:   FD=%d; index=%d\n", newSocket, i);
-			clientList[i] = newSocket;
-			// Create a new peer, save data, and add to peerList
-			socketSaved = 1;
+	// The listen socket is edge triggered, so accept until there
+	// are no more connections waiting
+	while (1) {
+		fromLen = sizeof(from);
+		newSocket = accept(listenSocket, (struct sockaddr *)&from, &fromLen);
+		if (newSocket < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				// e.g. out of file descriptors. Keep serving the peers we have
+				perror("accept");
+			}
+			return;
+		}
+		DEBUG("   Client accepted:   FD=%d\n", newSocket);
+
+		conn = (connection*)calloc(1, sizeof(connection));
+		if (conn != NULL) {
+			// Peer is going to send it's hostname and port number after
+			// connection. It is added to the peerList once we have both.
+			conn->pending = (struct peer*)slabAlloc(&peerPool);
+			if (conn->pending != NULL)
+				memset(conn->pending, 0, sizeof(struct peer));
+		}
+		if (conn == NULL || conn->pending == NULL) {
+			printf("   No memory left for new client!\n");
+			free(conn);
+			close(newSocket);
+			continue;
+		}
+		conn->socket = newSocket;
+		conn->state = CONN_WAIT_HOSTNAME;
+		conn->pending->address = from.sin_addr;
+		addToHandshakeList(conn);
+
+		setSocketBlockingEnabled(newSocket, 0);
+
+		// EPOLLOUT is edge triggered too, so it is only reported when a
+		// full socket has room again and can stay registered all the time
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, newSocket, &event) < 0) {
+			perror("epoll_ctl");
+			handleClientDisconnect(conn);
 		}
 	}
-	if (socketSaved != 1)
-	{
-		// Our array is full
-		printf("   No space left for new client!\n");
-		close(newSocket);
+}
+
+// Runs one complete request
+void handleRequest(char* data, int len, connection* conn)
+{
+	request req;
+	DEBUG("handleRequest()\n");
+	printf("Received:[%.*s]\n", len, data);
+
+	parseRequest(data, len, &req);
+	if (req.version.len == 0) {
+		printf("   ERROR: Malformed request line\n");
+		send400(conn);
 		return;
 	}
-	
-	char buf[LEN];
-	memset(&buf, 0, sizeof(buf));
-	// Peer is going to send it's hostname and port number after connection
-    struct peer* newPeer = (struct peer*)malloc(sizeof(struct peer));
-	memset(newPeer, 0, sizeof(struct peer));
-	//len = recv(newSocket, newPeer->hostname, LEN, 0);
-	len = recv(newSocket, buf, LEN-1, 0);
-	if ( len < 0 ) {
-		perror("recv");
-		exit(1);
-	}
-	memcpy(&newPeer->hostname[0], &buf, len);
-	newPeer->hostname[strlen(buf)] = '\0';
-	DEBUG("   Received host [%s]\n", newPeer->hostname);
-	
-	// Send Ack
-	char str[2];  // Ack string
-	str[0] = 'A';
-    str[1] = '\0';
-    len = send(newSocket, str, strlen(str), 0);
-    if ( len != strlen(str) ) {
-        perror("send");
-        exit(1);
-    }
+	// Check to see which command was received
+	// Valid methods: ADD, BULKADD, LOOKUP, LIST
+	if (viewEquals(req.method, "ADD")) {
+		add(&req, conn);
+	} else if (viewEquals(req.method, "LOOKUP")) {
+		lookup(&req, conn);
+	} else if (viewEquals(req.method, "LIST")) {
+		list(&req, conn);
+	} else if (viewEquals(req.method, "BULKADD")) {
+		bulkAdd(&req, conn);
+	} else {
+		printf("   ERROR: Invalid command:\n%.*s\n", len, data);
+		send400(conn);
+	}
+}
 
-	// Receive port number
-	int32_t ret;
-	len = recv(newSocket, &ret, sizeof(ret), 0);
-    if ( len < 0 ) {
-        perror("recv");
-        exit(1);
-    }
-	newPeer->port = ntohl(ret);
-	DEBUG("   Received port [%d]\n", newPeer->port);
-	
-	// Set socket so we can search for the peer to delete
-	// by the socket that we detected a close on
-	newPeer->socket = newSocket;
-
-	// Send Ack
-    len = send(newSocket, str, strlen(str), 0);
-    if ( len != strlen(str) ) {
-        perror("send");
-        exit(1);
-    }
-    
-    // Add the new peer to the peerList
-    addToPeerList(newPeer);
-	
-	setSocketBlockingEnabled(newSocket, 0);
+void addToReadyList(connection* conn)
+{
+	DEBUG("addToReadyList()\n");
+	if (conn->onReadyList)
+		return;
+	conn->onReadyList = true;
+	conn->readyNext = NULL;
+	conn->readyPrev = readyTail;
+	if (readyTail != NULL)
+		readyTail->readyNext = conn;
+	else
+		readyHead = conn;
+	readyTail = conn;
+}
+
+void deleteFromReadyList(connection* conn)
+{
+	DEBUG("deleteFromReadyList()\n");
+	if (!conn->onReadyList)
+		return;
+	if (conn->readyPrev != NULL)
+		conn->readyPrev->readyNext = conn->readyNext;
+	else
+		readyHead = conn->readyNext;
+	if (conn->readyNext != NULL)
+		conn->readyNext->readyPrev = conn->readyPrev;
+	else
+		readyTail = conn->readyPrev;
+	conn->readyPrev = conn->readyNext = NULL;
+	conn->onReadyList = false;
+}
+
+// Finds the end of the request starting at 'start'. A request ends with a
+// blank line. Peers are not consistent about line endings, so "\n\n",
+// "\n\r\n" (which covers "\r\n\r\n" and "\n\r\n\r") are all accepted.
+// Returns the offset of the newline ending the last header line, or -1 if
+// the request is not complete yet.
+int findRequestEnd(char* buf, int start, int len)
+{
+	char *p = buf + start;
+	char *end = buf + len;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		if (p + 1 < end && p[1] == '\n')
+			return p - buf;
+		if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+			return p - buf;
+		p++;
+	}
+	return -1;
 }
 
-void handleData(int clientNum) 
+// Runs the complete requests in the connection's read buffer, in the order
+// they were sent, until 'budget' runs out or the peer has too many replies
+// waiting. A LIST still being sent finishes before the next request runs.
+// Anything left (including a partial request) is kept for later. Returns 0 if a request is
+// longer than MAX_REQUEST_SIZE, however it arrived, and the connection should be dropped.
+int processRequests(connection* conn, int* budget)
 {
-	char buf[LEN];
-	char data[MAX_MSG_SIZE];
-	int j, len, totalLen = 0;
+	int start = 0;
+	int end;
+	bool tooLarge = false;
+	DEBUG("processRequests()\n");
+
+	if (conn->listing && conn->outQueued < outHighWater) {
+		continueList(conn);
+	}
+	while (start < conn->readLen && *budget > 0 && conn->outQueued < outHighWater && !conn->listing)
+	{
+		// Skip the line ending left over from the previous request's blank line
+		if (conn->readBuf[start] == '\r' || conn->readBuf[start] == '\n') {
+			start++;
+			continue;
+		}
+		// Carry on from where the last read left off rather than search
+		// a request that arrives in pieces from its start every time. A
+		// blank line may begin in the last two bytes searched.
+		end = findRequestEnd(conn->readBuf, (conn->scanned > start) ? conn->scanned : start, conn->readLen);
+		if (end < 0) {
+			conn->scanned = (conn->readLen - 2 > start) ? conn->readLen - 2 : start;
+			tooLarge = (conn->readLen - start > MAX_REQUEST_SIZE);
+			break;
+		}
+		if (end - start > MAX_REQUEST_SIZE) {
+			tooLarge = true;
+			break;
+		}
+		conn->scanned = 0;
+		handleRequest(&conn->readBuf[start], end - start, conn);
+		(*budget)--;
+		start = end + 2;
+	}
+	if (tooLarge) {
+		printf("   ERROR: Request from client %d is too large\n", conn->socket);
+		send400(conn);
+		flushOutput(conn); // best effort, the connection is dropped next
+		return 0;
+	}
+
+	// Keep whatever is left for the next read
+	conn->readLen -= start;
+	conn->scanned = (conn->scanned > start) ? conn->scanned - start : 0;
+	if (conn->readLen > 0) {
+		memmove(conn->readBuf, &conn->readBuf[start], conn->readLen);
+	}
+	else {
+		// Idle peers should not hold on to a buffer
+		conn->readLen = 0;
+		free(conn->readBuf);
+		conn->readBuf = NULL;
+		conn->readCap = 0;
+	}
+	return 1;
+}
+
+// Makes sure there is room to read more into the connection's buffer.
+// Returns 0 if we are out of memory.
+int growReadBuffer(connection* conn)
+{
+	int newCap;
+	char *newBuf;
+
+	if (conn->readCap - conn->readLen > 0) {
+		return 1;
+	}
+	newCap = (conn->readCap == 0) ? READ_BUF_INITIAL : conn->readCap * 2;
+	newBuf = realloc(conn->readBuf, newCap);
+	if (newBuf == NULL) {
+		printf("   No memory left for client %d!\n", conn->socket);
+		return 0;
+	}
+	conn->readBuf = newBuf;
+	conn->readCap = newCap;
+	return 1;
+}
+
+// Reads what the peer has sent and runs each complete request as soon as it
+// has arrived. Peers may pipeline requests, so one peer could keep us busy
+// indefinitely; after MAX_REQUESTS_PER_TURN requests it goes on the ready
+// list and the other peers get a turn first. A peer that is not reading its
+// replies stops being read from once outHighWater bytes are waiting for it.
+void handleData(connection* conn) 
+{
+	int len;
+	int budget = MAX_REQUESTS_PER_TURN;
 	
-	DEBUG("handleData() from client %d\n", clientNum);
-	memset(&data, '\0', MAX_MSG_SIZE);
+	DEBUG("handleData() from client %d\n", conn->socket);
+	deleteFromReadyList(conn);
 	
-    while (1)
+	// Requests left over from the previous turn go first
+	if (conn->readLen > 0 && !processRequests(conn, &budget)) {
+		handleClientDisconnect(conn);
+		return;
+	}
+	
+    while (budget > 0 && conn->outQueued < outHighWater && !conn->listing)
     {
-        int err;
-        memset(&buf, '\0', LEN);
-        len = recv(clientList[clientNum], buf, LEN-1, 0);
-        err = errno; // save off errno
-        //printf("Debug: recv = %d", len);
+        if (!growReadBuffer(conn)) {
+            handleClientDisconnect(conn);
+            return;
+        }
+        len = recv(conn->socket, &conn->readBuf[conn->readLen], conn->readCap - conn->readLen, 0);
         if ( len < 0 ) {
-        	totalLen = 0;
-            if (( err == EAGAIN ) || (err == EWOULDBLOCK)) { // No more data
-                printf("Received:[%s]\n", data);
-                // Check to see which command was received
-                // Valid methods: ADD, LOOKUP, LIST
-                if (data[0] == 'A' && data[1] == 'D' && data[2] == 'D') {
-                	add(&data, clientNum);
-                } else if (data[0] == 'L' && data[1] == 'O' && data[2] == 'O') {
-                	lookup(&data, clientNum);
-                } else if (data[0] == 'L' && data[1] == 'I' && data[2] == 'S') {
-                	list(&data, clientNum);
-                } else {
-                	printf("   ERROR: Invalid command:\n%s\n", data);
-                	send400(clientNum);
-                }
-				return;
+            if (( errno == EAGAIN ) || (errno == EWOULDBLOCK)) { // No more data
+                // Send the replies to everything we just ran
+                if (!flushOutput(conn))
+                    handleClientDisconnect(conn);
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
             }
+            // Connection reset or similar, drop the peer
             perror("recv");
+            handleClientDisconnect(conn);
+            return;
         }
         else if (len == 0) {
-            // We got a close
-            printf("   Close from client %d\n", clientNum);
-            handleClientDisconnect(clientNum);
-            break;
+            // We got a close. The peer may only have shut down its side,
+            // so it still gets the replies to what it sent first.
+            printf("   Close from client %d\n", conn->socket);
+            conn->readClosed = true;
+            conn->readPaused = true;
+            handleWritable(conn);
+            return;
         }
         else {
-            memcpy(&data[totalLen], &buf, len);
-            totalLen += len;
-            DEBUG("   Received [%s]\n", buf);
+            conn->readLen += len;
+            if (!processRequests(conn, &budget)) {
+                handleClientDisconnect(conn);
+                return;
+            }
         }
     } // while
-
-
+    
+    // Send what we can, and more of a LIST if the socket takes it all
+    if (!handleWritable(conn))
+        return;
+    if (conn->outQueued >= outHighWater || conn->listing) {
+        // Leave its requests in the socket until it catches up.
+        // handleWritable() sends the rest of a LIST and starts reading again.
+        DEBUG("   Pausing client %d, %d bytes queued\n", conn->socket, conn->outQueued);
+        conn->readPaused = true;
+        return;
+    }
+    // Out of turns before reaching EAGAIN, so come back to this peer
+    addToReadyList(conn);
 }
 
-// Some socket is ready for reading. Handle it
-void handleSocketRead() {
-	int i;
-	
-	DEBUG("handleSocketRead()\n");
-	// See if a new client is trying to connect to the listening socket
-	if (FD_ISSET(listenSocket, &readset))
-		handleNewClient();
-		
-	// Loop through clients to see if one of them is sending data
-	for (i=0; i < MAX_CLIENTS; i++) {
-		if (FD_ISSET(clientList[i], &readset)) {
-			handleData(i);
+// The socket has room again. Sends more of the queued replies, queueing
+// more of a LIST as they go, and once a paused peer has taken half of what
+// was waiting, reads its requests again. A peer that has closed its side
+// is dropped once it has everything. Returns 0 if the connection was
+// dropped.
+int handleWritable(connection* conn)
+{
+	DEBUG("handleWritable() for client %d\n", conn->socket);
+	if (!flushOutput(conn)) {
+		handleClientDisconnect(conn);
+		return 0;
+	}
+	// Keep going while the socket takes everything, as there may be no
+	// other EPOLLOUT to come back on
+	while (conn->listing && conn->outQueued < outHighWater) {
+		continueList(conn);
+		if (!flushOutput(conn)) {
+			handleClientDisconnect(conn);
+			return 0;
 		}
-	}		
+	}
+	if (conn->readClosed) {
+		if (conn->outHead != NULL || conn->listing)
+			return 1;
+		handleClientDisconnect(conn);
+		return 0;
+	}
+	if (conn->readPaused && !conn->listing && conn->outQueued < outHighWater / 2) {
+		DEBUG("   Resuming client %d\n", conn->socket);
+		conn->readPaused = false;
+		// Requests may have been waiting all along and the socket is edge
+		// triggered, so go and read them
+		addToReadyList(conn);
+	}
+	return 1;
 }
 
-main (int argc, char *argv[])
+// Gives each connection on the ready list another turn. Connections that
+// still have more to do go back on the end of the list.
+void handleReadyList()
 {
-    char buf[LEN];
-    char host[LEN];
-    char str[LEN];
-    int p, fp, rc, len, port, numPlayers, numHops, a, flags, result;
-    struct hostent *hp, *ihp;
-    struct sockaddr_in sin, incoming;
-    fd_set tempset;
-    struct timeval tv;
-    int on=1;
+	connection *conn;
+	connection *last = readyTail;
+	DEBUG("handleReadyList()\n");
+
+	while (readyHead != NULL) {
+		conn = readyHead;
+		handleData(conn);
+		if (conn == last)
+			break;
+	}
+}
 
-    memset(&sin, 0, sizeof(sin));
-    memset(&incoming, 0, sizeof(incoming));
-    
-    port = WELL_KNOWN_PORT;
-    
-    /* fill in hostent struct for self */
-    gethostname(host, sizeof(host));
-    hp = gethostbyname(host);
-    printf("Hostname: %s\n", host);
-    if ( hp == NULL ) {
-        fprintf(stderr, "%s: host not found (%s)\n", argv[0], host);
-        exit(1);
-    }
+// Runs one worker: its own listen socket and epoll instance, and an event
+// loop for every connection it accepts. Connections stay with the worker
+// that accepted them, so only the index and the peer list are shared.
+void* runWorker(void* arg)
+{
+    myReader = &rcuReaders[(intptr_t)arg];
+
+    struct epoll_event event;
+    struct epoll_event events[MAX_EVENTS];
+    int rc, result;
+    int on=1;
     
     /* open a socket for listening
      * 4 steps:
@@ -924,48 +2330,189 @@ main (int argc, char *argv[])
 		exit (-1);
 	}
 	
+	// With several workers, each has its own listen socket on the same
+	// port and the kernel shares new connections out between them
+	if (workerCount > 1 && (rc = setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on))) < 0)
+	{
+		perror("setsockopt() error");
+		close(listenSocket);
+		exit (-1);
+	}
+	
 	setSocketBlockingEnabled(listenSocket, 0);
 	
-    /* set up the address and port */
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(port);
-    memcpy(&sin.sin_addr, hp->h_addr_list[0], hp->h_length);
-    
-    /* bind socket s to address sin */
-    rc = bind(listenSocket, (struct sockaddr *)&sin, sizeof(sin));
+    /* bind socket s to address listenAddress */
+    rc = bind(listenSocket, (struct sockaddr *)&listenAddress, sizeof(listenAddress));
     if ( rc < 0 ) {
         perror("bind:");
         exit(rc);
     }
     
-    rc = listen(listenSocket, 5);
+    rc = listen(listenSocket, SOMAXCONN);
     if ( rc < 0 ) {
         perror("listen:");
         exit(rc);
     }
     
-    maxfd = listenSocket; // Only one so far
-
+    epollFd = epoll_create1(0);
+    if ( epollFd < 0 ) {
+        perror("epoll_create1:");
+        exit(1);
+    }
+    
+    // The listen socket is the only one registered without a connection
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if ( epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &event) < 0 ) {
+        perror("epoll_ctl:");
+        exit(1);
+    }
     
     /* accept connections and handle data */
-    int i, j;
+    int i, timeout;
+    connection *conn;
     
     while (1) {
-    	updateSelectList();
-    	tv.tv_sec = 10;
-        tv.tv_usec = 0;
+        // Wake up in time to drop the oldest peer that has not registered
+        timeout = 10000;
+        if (readyHead != NULL) {
+            // Peers are waiting for another turn, just poll
+            timeout = 0;
+        }
+        else if (handshakeHead != NULL) {
+            long long untilDeadline = handshakeHead->deadline - nowMs();
+            if (untilDeadline < timeout)
+                timeout = (untilDeadline > 0) ? (int)untilDeadline : 0;
+        }
+        // Come back soon to free retired index memory
+        if (retiredHead != NULL && timeout > RECLAIM_INTERVAL)
+            timeout = RECLAIM_INTERVAL;
+        
+        // Nothing from the index is held between turns, so this worker is
+        // out of the way of the grace period while it sleeps
+        rcuOffline();
+        reclaimRetired();
         
-        // select() returns the number of sockets that are ready for reading
-        result = select(maxfd + 1, &readset, NULL, NULL, &tv);
+        // epoll_wait() returns the number of sockets that are ready
+        result = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        rcuOnline();
         
-        if (result == 0) { // select timed out
-        } 
-        else if (result < 0 && errno != EINTR) {
-            perror("select");
+        if (result < 0 && errno != EINTR) {
+            perror("epoll_wait");
             exit(1);
         }
+        
+        for (i = 0; i < result; i++) {
+            if (events[i].data.ptr == NULL) {
+                // A new client is trying to connect to the listening socket
+                handleNewClient();
+            }
+            else {
+                conn = (connection*)events[i].data.ptr;
+                // Room to send more of a long reply
+                if ((events[i].events & EPOLLOUT) && conn->outHead != NULL) {
+                    if (!handleWritable(conn))
+                        continue;
+                }
+                // A paused peer that is gone will never take its replies
+                if (conn->readPaused && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                    handleClientDisconnect(conn);
+                    continue;
+                }
+                // A client is sending data or has closed. A close is seen
+                // as a zero length read. Paused peers are read once they
+                // have caught up.
+                if (!conn->readPaused && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                    if (conn->state == CONN_READY)
+                        handleData(conn);
+                    else
+                        handleHandshake(conn);
+                }
+            }
+        }
+        
+        handleReadyList();
+        expireHandshakes();
+    }
+    return NULL;
+}
+
+main (int argc, char *argv[])
+{
+    char buf[LEN];
+    char host[LEN];
+    char str[LEN];
+    int p, fp, rc, len, port, numPlayers, numHops, a, flags, i;
+    struct hostent *hp, *ihp;
+    struct sockaddr_in incoming;
+    struct rlimit limit;
+    pthread_t thread;
+
+    memset(&listenAddress, 0, sizeof(listenAddress));
+    memset(&incoming, 0, sizeof(incoming));
+    
+    port = WELL_KNOWN_PORT;
+    
+    // -w <bytes> sets how much output may be queued for a peer before we
+    // stop reading its requests. -a leaves peers' addresses out of rows.
+    // -t <threads> runs that many workers, each serving a share of the peers.
+    while ((a = getopt(argc, argv, "w:at:")) != -1) {
+        if (a == 'w' && atoi(optarg) > 0) {
+            outHighWater = atoi(optarg);
+        }
+        else if (a == 'a') {
+            sendAddresses = false;
+        }
+        else if (a == 't' && atoi(optarg) > 0) {
+            workerCount = atoi(optarg);
+        }
         else {
-        	handleSocketRead();
+            fprintf(stderr, "Usage: %s [-w output-high-water-bytes] [-a] [-t threads]\n", argv[0]);
+            exit(1);
+        }
+    }
+    
+    // A peer that disappears while we are sending to it should only lose
+    // its own connection, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Every peer holds a connection open for as long as it is in the
+    // system, so allow as many open sockets as the hard limit does
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    /* fill in hostent struct for self */
+    gethostname(host, sizeof(host));
+    hp = gethostbyname(host);
+    printf("Hostname: %s\n", host);
+    if ( hp == NULL ) {
+        fprintf(stderr, "%s: host not found (%s)\n", argv[0], host);
+        exit(1);
+    }
+    
+    /* set up the address and port */
+    listenAddress.sin_family = AF_INET;
+    listenAddress.sin_port = htons(port);
+    memcpy(&listenAddress.sin_addr, hp->h_addr_list[0], hp->h_length);
+    
+    initRfcIndex();
+    initInternTable();
+    rcuReaders = (rcuReader*)calloc(workerCount, sizeof(rcuReader));
+    if (rcuReaders == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    
+    // Every worker but the first gets a thread of its own; this thread
+    // runs the first
+    printf("Running %d worker%s\n", workerCount, (workerCount > 1) ? "s" : "");
+    for (i = 1; i < workerCount; i++) {
+        if (pthread_create(&thread, NULL, runWorker, (void*)(intptr_t)i) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
+    runWorker((void*)(intptr_t)0);
 }